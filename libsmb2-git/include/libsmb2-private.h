@@ -52,6 +52,8 @@ extern "C" {
 
 #define SMB2_SIGNATURE_SIZE 16
 #define SMB2_KEY_SIZE 16
+/* large enough for the AES-256 cipher keys */
+#define SMB2_CIPHER_KEY_SIZE 32
 
 #define SMB2_MAX_VECTORS 256
 
@@ -121,6 +123,23 @@ enum smb2_recv_state {
 #define smb2_tree_id(smb2) (((smb2)->tree_id_cur >= 0)?smb2->tree_id[(smb2)->tree_id_cur]:0xdeadbeef)
 
 #define MAX_CREDITS 1024
+/* The waitqueue is hashed on the low bits of the message id. Ids are
+ * handed out mostly in order, which spreads the PDUs in flight well, but
+ * a multi-credit request uses up several ids and a CHANGE_NOTIFY can wait
+ * for a very long time, so buckets do collide. Colliding PDUs are chained
+ * in the bucket, see WAITQUEUE_BUCKET() in pdu.c.
+ */
+#define SMB2_WAITQUEUE_HASH_SIZE MAX_CREDITS
+/* Freed PDUs kept for reuse. With its two iovec arrays and the arena a
+ * PDU is 6-7 KB, so the 68k Amigas keep only a few of them around.
+ */
+#if defined(__AMIGA__) && !defined(__amigaos4__) && !defined(__AROS__)
+#define SMB2_PDU_POOL_SIZE 8
+#else
+#define SMB2_PDU_POOL_SIZE 32
+#endif
+/* Room for the fixed part, name and padding of a typical request */
+#define SMB2_PDU_ARENA_SIZE 512
 #define SMB2_SALT_SIZE 32
 
 struct sync_cb_data {
@@ -129,6 +148,119 @@ struct sync_cb_data {
 	void *ptr;
 };
 
+/* Slots for the sync_cb_data of sync calls, see sync.c. At most 32. */
+#define SMB2_SYNC_SLOTS 16
+
+struct smb2_sync_slot {
+        struct sync_cb_data cb_data;
+        uintptr_t generation;
+        int in_use;
+};
+
+/*
+ * Time the sync calls spent blocked waiting for the server, see
+ * wait_for_reply() and smb2_set_sync_stats(). hist[] is log2 bucketed
+ * by microseconds, see smb2_latency_bucket().
+ */
+#define SMB2_LATENCY_BUCKETS 24
+
+struct smb2_sync_stats {
+        int enabled;
+        uint32_t waits;
+        uint64_t wait_us;
+        uint32_t hist[SMB2_LATENCY_BUCKETS];
+};
+
+/*
+ * Wire trace, see smb2_set_trace_size(). One record per request PDU,
+ * filled in as it is queued, sent and answered. The fields and flags
+ * are those of the dump format described in libsmb2.h.
+ */
+struct smb2_trace_rec {
+        uint64_t message_id;
+        uint64_t queue_us;
+        uint32_t seq;
+        uint32_t send_us;
+        uint32_t reply_us;
+        uint32_t status;
+        uint32_t out_bytes;
+        uint32_t in_bytes;
+        uint16_t command;
+        uint16_t credit_charge;
+        uint16_t credit_request;
+        uint16_t credit_grant;
+        uint16_t credits;       /* credits available when queued */
+        uint16_t flags;
+};
+
+#define SMB2_TRACE_MAX_RECORDS (1U << 20)
+
+struct smb2_trace {
+        uint32_t mask;          /* number of records - 1 */
+        uint32_t seq;           /* last sequence number handed out */
+        struct smb2_trace_rec recs[];
+};
+
+/*
+ * Per filehandle state for smb2_pwrite_behind().
+ * cb_data.status holds the first error of a write that has already been
+ * acknowledged to the caller, until it is reported by the next call.
+ */
+struct smb2_write_behind {
+        struct sync_cb_data cb_data;
+        int in_flight;
+        /* Each write in flight holds a copy of its data */
+        uint32_t bytes_in_flight;
+};
+
+/*
+ * Per filehandle state for smb2_pread_ahead().
+ */
+#define SMB2_READ_AHEAD_CHUNK_SIZE 65536
+
+enum smb2_read_ahead_state {
+        SMB2_RA_EMPTY = 0,
+        SMB2_RA_IN_FLIGHT,
+        SMB2_RA_DONE,
+        /* Still in flight, but the data is no longer wanted */
+        SMB2_RA_STALE,
+};
+
+struct smb2_read_ahead_chunk {
+        uint8_t *buf;
+        uint64_t offset;
+        /* Requested length while in flight, bytes read once done */
+        uint32_t len;
+        int status;
+        enum smb2_read_ahead_state state;
+        int used;
+};
+
+struct smb2_read_ahead {
+        struct sync_cb_data cb_data;
+        struct smb2_read_ahead_chunk *chunks;
+        int num_chunks;
+        /* Number of chunks to keep ahead of the reader */
+        int window;
+        int in_flight;
+        /* Offset a sequential reader will ask for next */
+        uint64_t next_offset;
+        /* A short read told us where the file ends */
+        int eof_known;
+        uint64_t eof;
+};
+
+/* State of smb2_pread_pipelined() on a filehandle */
+struct smb2_pread_pipeline {
+        struct sync_cb_data cb_data;
+        int in_flight;
+        /* Where the data ends, pulled in by a short read */
+        uint64_t end;
+};
+
+struct aes_gcm_key;
+struct smb2_signing_ctx;
+
 struct smb2_context {
 
         t_socket fd;
@@ -166,6 +298,8 @@ struct smb2_context {
         smb2_command_cb connect_cb;
         void *connect_data;
         struct sync_cb_data connect_cb_data;
+        struct smb2_sync_slot sync_slots[SMB2_SYNC_SLOTS];
+        struct smb2_sync_stats sync_stats;
 
         int credits;
 
@@ -183,8 +317,20 @@ struct smb2_context {
         uint8_t seal:1;
         uint8_t sign:1;
         uint8_t signing_key[SMB2_KEY_SIZE];
-        uint8_t serverin_key[SMB2_KEY_SIZE];
-        uint8_t serverout_key[SMB2_KEY_SIZE];
+        /* expanded signing key, set up by smb2_init_signing_ctx() */
+        struct smb2_signing_ctx *signing_ctx;
+        uint8_t serverin_key[SMB2_CIPHER_KEY_SIZE];
+        uint8_t serverout_key[SMB2_CIPHER_KEY_SIZE];
+        /* expanded cipher keys, set up by smb3_init_cipher_keys() */
+        struct aes_gcm_key *serverin_cipher;
+        struct aes_gcm_key *serverout_cipher;
+        /* last nonce used to seal a PDU, restarts with every new key */
+        uint64_t seal_nonce;
+        /* reusable buffers for the sealed PDU being sent and received */
+        uint8_t *crypt_buf;
+        size_t crypt_buf_size;
+        uint8_t *trfm_buf;
+        size_t trfm_buf_size;
         uint8_t salt[SMB2_SALT_SIZE];
         uint16_t cypher;
         uint8_t preauthhash[SMB2_PREAUTH_HASH_SIZE];
@@ -205,7 +351,12 @@ struct smb2_context {
          * For sending PDUs
          */
         struct smb2_pdu *outqueue;
-        struct smb2_pdu *waitqueue;
+        /* PDUs waiting for a reply, hashed by message_id */
+        struct smb2_pdu *waitqueue[SMB2_WAITQUEUE_HASH_SIZE];
+        int waitqueue_count;
+        /* Freed PDUs, recycled by smb2_allocate_pdu() */
+        struct smb2_pdu *pdu_pool;
+        int pdu_pool_count;
 
         /*
          * For receiving PDUs
@@ -256,6 +407,17 @@ struct smb2_context {
         uint32_t max_write_size;
         uint16_t dialect;
 
+        /* Bytes smb2_pwrite_behind() may leave in flight per filehandle */
+        uint32_t write_behind_window;
+        /* Writes in flight on all filehandles, see smb2_write_behind_pending */
+        int write_behind_in_flight;
+        /* Maximum number of chunks smb2_pread_ahead() may prefetch */
+        int read_ahead_max;
+        /* Requested QUERY_DIRECTORY output buffer size, 0 for default */
+        uint32_t dir_buffer_size;
+        /* Wire trace ring, NULL unless enabled */
+        struct smb2_trace *trace;
+
         char error_string[MAX_ERROR_SIZE];
         int nterror;
 
@@ -305,6 +467,22 @@ struct smb2_pdu {
          */
         smb2_free_payload free_payload;
 
+        /* Data we need to retain between request/reply for QUERY INFO */
+        uint8_t info_type;
+        uint8_t file_info_class;
+
+        /* For encrypted PDUs, crypt points into smb2->crypt_buf */
+        uint8_t seal:1;
+        uint32_t crypt_len;
+        unsigned char *crypt;
+        time_t timeout;
+        /* Sequence number of the trace record, 0 if not traced */
+        uint32_t trace_seq;
+
+        /* Everything above is cleared when a PDU is taken from the
+         * free list, the members below are reset explicitly.
+         */
+
         /* For sending/receiving
          * out contains at least two vectors:
          * [0]  64 bytes for the smb header
@@ -316,15 +494,11 @@ struct smb2_pdu {
         struct smb2_io_vectors out;
         struct smb2_io_vectors in;
 
-        /* Data we need to retain between request/reply for QUERY INFO */
-        uint8_t info_type;
-        uint8_t file_info_class;
-
-        /* For encrypted PDUs */
-        uint8_t seal:1;
-        uint32_t crypt_len;
-        unsigned char *crypt;
-        time_t timeout;
+        /* Bump allocator for the buffers the encoders add to out,
+         * see smb2_add_iovector_alloc().
+         */
+        size_t arena_used;
+        uint64_t arena[SMB2_PDU_ARENA_SIZE / sizeof(uint64_t)];
 };
 
 struct smb2_dirent_internal {
@@ -332,6 +506,18 @@ struct smb2_dirent_internal {
         struct smb2dirent dirent;
 };
 
+/* Entries and their names are bump allocated from a list of chunks
+ * owned by the smb2dir, see dirent_alloc().
+ */
+#define SMB2_DIRENT_CHUNK_SIZE 16384
+
+struct smb2_dirent_chunk {
+        struct smb2_dirent_chunk *next;
+        size_t size;
+        size_t used;
+        /* followed by size bytes of entries and names */
+};
+
 struct smb2dir {
         struct smb2dir *next;
         smb2_command_cb cb;
@@ -339,9 +525,25 @@ struct smb2dir {
         void *cb_data;
         smb2_file_id file_id;
 
+        struct smb2_dirent_chunk *chunks;
         struct smb2_dirent_internal *entries;
+        struct smb2_dirent_internal *last_entry;
         struct smb2_dirent_internal *current_entry;
         int index;
+
+        /* Directories opened through the sync API are streamed: the
+         * handle stays open and only the most recent QUERY_DIRECTORY
+         * batch is kept in entries. base_index is the position of the
+         * first entry of that batch.
+         */
+        int streaming;
+        int fetching;
+        int closing;
+        int eof;
+        int status;
+        int base_index;
+        /* Batches fetched by the sync API complete through this */
+        struct sync_cb_data sync_cb_data;
 };
 
 
@@ -375,6 +577,18 @@ int smb2_process_payload_variable(struct smb2_context *smb2,
 int smb2_get_fixed_size(struct smb2_context *smb2, struct smb2_pdu *pdu);
 
 struct smb2_pdu *smb2_find_pdu(struct smb2_context *smb2, uint64_t message_id);
+void smb2_waitqueue_add(struct smb2_context *smb2, struct smb2_pdu *pdu);
+void smb2_free_pdu_pool(struct smb2_context *smb2);
+void smb2_trace_sent(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                     uint32_t bytes);
+void smb2_trace_reply(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                      uint32_t status, uint16_t credit_grant,
+                      uint32_t bytes);
+struct smb2_iovec *smb2_add_iovector_alloc(struct smb2_context *smb2,
+                                           struct smb2_pdu *pdu,
+                                           size_t len);
+void smb2_waitqueue_remove(struct smb2_context *smb2, struct smb2_pdu *pdu);
+struct smb2_pdu *smb2_waitqueue_pop(struct smb2_context *smb2);
 void smb2_free_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v);
 
 void smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_data, void *cb_data);
@@ -384,6 +598,20 @@ int smb2_decode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
 int smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
                         struct smb2_iovec *iov, size_t niov);
 
+/* Bucket 0 counts latencies below 1us, bucket i those from 2^(i-1) up
+ * to 2^i us and the last bucket everything longer. */
+int smb2_latency_bucket(uint64_t us);
+
+int smb2_decode_fileidfulldirectoryinformation_fields(
+    struct smb2_context *smb2,
+    struct smb2_fileidfulldirectoryinformation *fs,
+    struct smb2_iovec *vec,
+    uint32_t *name_len);
+
+size_t smb2_utf16_utf8_size(const uint16_t *utf16, size_t utf16_len);
+void smb2_utf16_to_utf8_buf(const uint16_t *utf16, size_t utf16_len,
+                            char *str);
+
 int smb2_set_uint8(struct smb2_iovec *iov, int offset, uint8_t value);
 int smb2_set_uint16(struct smb2_iovec *iov, int offset, uint16_t value);
 int smb2_set_uint32(struct smb2_iovec *iov, int offset, uint32_t value);
@@ -639,7 +867,19 @@ int smb2_decode_reparse_data_buffer(struct smb2_context *smb2,
                                     struct smb2_reparse_data_buffer *rp,
                                     struct smb2_iovec *vec);
 void smb2_free_all_fhs(struct smb2_context *smb2);
+/* Frees fh without closing it on the server. Its reads and writes that
+ * are still queued or in flight are failed with STATUS_CANCELLED. */
+void smb2_abandon_fh(struct smb2_context *smb2, struct smb2fh *fh);
+struct smb2_write_behind *smb2_fh_write_behind(struct smb2fh *fh);
+struct smb2_read_ahead *smb2_fh_read_ahead(struct smb2fh *fh);
+struct smb2_pread_pipeline *smb2_fh_pread_pipeline(struct smb2fh *fh);
 void smb2_free_all_dirs(struct smb2_context *smb2);
+int smb2_opendir_streaming_async(struct smb2_context *smb2, const char *path,
+                                 smb2_command_cb cb, void *cb_data);
+int smb2_query_dirents_async(struct smb2_context *smb2, struct smb2dir *dir,
+                             uint8_t flags);
+int smb2_fetch_dirents(struct smb2_context *smb2, struct smb2dir *dir,
+                       uint8_t flags);
 
 int smb2_read_from_buf(struct smb2_context *smb2);
 void smb2_change_events(struct smb2_context *smb2, t_socket fd, int events);
@@ -259,6 +259,17 @@ int smb2_service(struct smb2_context *smb2, int revents);
  */
 int smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents);
 
+/*
+ * Process whatever has already arrived on the socket, without blocking.
+ * Meant for users of the sync API that also have async requests, such
+ * as change notifications, outstanding between sync calls.
+ *
+ * Returns:
+ *  0 : Success.
+ * <0 : Unrecoverable failure, same as smb2_service().
+ */
+int smb2_service_nowait(struct smb2_context *smb2);
+
 /*
  * Set the timeout in seconds after which a command will be aborted with
  * SMB2_STATUS_IO_TIMEOUT.
@@ -269,6 +280,101 @@ int smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents);
  */
 void smb2_set_timeout(struct smb2_context *smb2, int seconds);
 
+/*
+ * Set the number of bytes that smb2_pwrite_behind() may leave in flight
+ * per filehandle when it returns. Each write in flight holds a copy of
+ * its data, so this is also the memory used per filehandle. The writes
+ * are split into chunks of a quarter of the window, at least 64kb, so
+ * that several of them can be outstanding. How many actually are is
+ * further limited by the credits granted by the server.
+ *
+ * Default is 0: smb2_pwrite_behind() waits for all its writes to complete.
+ */
+void smb2_set_write_behind_window(struct smb2_context *smb2, uint32_t bytes);
+
+/*
+ * Set the maximum number of 64kb chunks that smb2_pread_ahead() may
+ * prefetch for a filehandle that is being read sequentially. The number
+ * of chunks actually prefetched adapts between 1 and this value.
+ * Only affects filehandles that have not been read from yet.
+ *
+ * Default is 0: No read-ahead.
+ */
+void smb2_set_read_ahead(struct smb2_context *smb2, int max_chunks);
+
+/*
+ * Set the size of the output buffer requested by each QUERY_DIRECTORY
+ * when listing a directory. Larger buffers return more entries per round
+ * trip. The size used is capped to the max_transact_size negotiated with
+ * the server, to 64kb if the server does not support multi-credit
+ * requests, and to what the currently granted credits can pay for.
+ *
+ * Default is 0: a platform dependent default, 64kb on most platforms.
+ */
+void smb2_set_dir_buffer_size(struct smb2_context *smb2, uint32_t size);
+
+/*
+ * Count the sync calls and time how long each was blocked waiting for
+ * the server. This costs two clock reads per call, which is noticeable
+ * on slow machines, so it is off unless enabled here.
+ *
+ * Default is 0: Disabled.
+ */
+void smb2_set_sync_stats(struct smb2_context *smb2, int enable);
+
+/*
+ * Keep a trace of the last nrecords request PDUs in memory: command,
+ * message id, credits charged, requested and granted, sizes, status and
+ * the times each was queued, sent and answered. Meant for diagnosing
+ * credit starvation and stalls without a packet capture.
+ * nrecords is rounded up to a power of two, 0 disables tracing.
+ * Enabling it again discards the records collected so far.
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+int smb2_set_trace_size(struct smb2_context *smb2, uint32_t nrecords);
+
+/*
+ * Write the trace to the file path, oldest record first.
+ *
+ * All values are little endian. The file starts with a header of
+ *   8 bytes  SMB2_TRACE_MAGIC
+ *   uint32   SMB2_TRACE_VERSION
+ *   uint32   record size, SMB2_TRACE_RECORD_SIZE
+ *   uint32   number of records that follow
+ *   uint32   sequence number of the last record, records with a lower
+ *            sequence number than the first one in the file were lost
+ * and each record is
+ *   uint64   message id
+ *   uint64   time queued, microseconds since the epoch
+ *   uint32   sequence number
+ *   uint32   time sent, microseconds after queued
+ *   uint32   time answered, microseconds after queued
+ *   uint32   NT status of the reply
+ *   uint32   bytes sent
+ *   uint32   bytes received, the frame size for compound replies
+ *   uint16   command
+ *   uint16   credit charge
+ *   uint16   credits requested
+ *   uint16   credits granted, including by interim replies
+ *   uint16   credits the client had when it was queued
+ *   uint16   SMB2_TRACE_* flags
+ *
+ * Returns 0 on success or -errno.
+ */
+#define SMB2_TRACE_MAGIC       "SMB2TRCE"
+#define SMB2_TRACE_VERSION     1
+#define SMB2_TRACE_RECORD_SIZE 52
+
+#define SMB2_TRACE_SENT      0x0001
+#define SMB2_TRACE_REPLIED   0x0002
+#define SMB2_TRACE_PENDING   0x0004  /* got an interim STATUS_PENDING */
+#define SMB2_TRACE_COMPOUND  0x0008  /* part of a compound chain */
+#define SMB2_TRACE_SEALED    0x0010
+#define SMB2_TRACE_TIMEOUT   0x0020  /* no reply within the timeout */
+
+int smb2_dump_trace(struct smb2_context *smb2, const char *path);
+
 /*
  * Set passthrough-enable.  Passthrough allows command packers
  * and unpackers to keep the extra data on complex commands
@@ -682,6 +788,11 @@ int smb2_opendir_async(struct smb2_context *smb2, const char *path,
 /*
  * Sync opendir()
  *
+ * The directory is streamed: opendir returns as soon as the first batch
+ * of entries has arrived and smb2_readdir() fetches the following batches
+ * as they are needed. Only one batch is buffered at any time and the
+ * directory handle stays open on the server until smb2_closedir().
+ *
  * Returns NULL on failure.
  */
 struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path);
@@ -699,11 +810,23 @@ void smb2_closedir(struct smb2_context *smb2, struct smb2dir *smb2dir);
  * readdir()
  */
 /*
- * smb2_readdir() never blocks, thus no async version is needed.
+ * smb2_readdir() never blocks for directories opened with
+ * smb2_opendir_async(). For directories opened with the sync
+ * smb2_opendir() it blocks while the next batch of entries is fetched.
+ *
+ * Returns NULL at the end of the directory or on error, use
+ * smb2_readdir_status() to tell the two apart.
  */
 struct smb2dirent *smb2_readdir(struct smb2_context *smb2,
                                 struct smb2dir *smb2dir);
 
+/*
+ * Returns 0 if the directory was read without error so far, -1 if the
+ * connection failed while waiting for a batch of entries or -errno if
+ * the server failed the request.
+ */
+int smb2_readdir_status(struct smb2_context *smb2, struct smb2dir *smb2dir);
+
 /*
  * rewinddir()
  */
@@ -772,6 +895,35 @@ int smb2_open_async(struct smb2_context *smb2, const char *path, int flags,
 struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags);
 struct smb2fh *smb2_open_r2(struct smb2_context *smb2, const char *path, int flags, int *r2);
 
+/*
+ * Async open of a directory as a filehandle, e.g. to watch it with
+ * smb2_notify_change_filehandle_async(). The directory is opened with
+ * full sharing so the handle does not prevent others from renaming or
+ * deleting it.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ *          Command_data is struct smb2fh.
+ *          This structure is freed using smb2_close().
+ * -errno : An error occurred.
+ *          Command_data is NULL.
+ */
+int smb2_open_dir_handle_async(struct smb2_context *smb2, const char *path,
+                               smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync open of a directory as a filehandle.
+ *
+ * Returns NULL on failure.
+ */
+struct smb2fh *smb2_open_dir_handle(struct smb2_context *smb2,
+                                    const char *path);
+
 /*
  * CLOSE
  */
@@ -876,6 +1028,36 @@ int smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
 int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                uint8_t *buf, uint32_t count, uint64_t offset);
 
+/*
+ * Sync pread() that splits the request into max_read_size chunks and
+ * keeps as many of them in flight as the available credits allow.
+ * Replies may complete in any order.
+ *
+ * Returns
+ *    >=0 : Number of bytes read. This is short only at end of file.
+ * -errno : An error occurred.
+ *
+ * On success the file position is moved to the end of the data read.
+ */
+int smb2_pread_pipelined(struct smb2_context *smb2, struct smb2fh *fh,
+                         uint8_t *buf, uint32_t count, uint64_t offset);
+
+/*
+ * Sync pread() with read-ahead.
+ * When the offsets of consecutive calls show that the file is read
+ * sequentially, the following chunks are prefetched asynchronously and
+ * later calls are served from memory. The data is discarded when the
+ * reader seeks elsewhere or writes to the file through
+ * smb2_pwrite_behind() or truncates it with smb2_ftruncate().
+ * See smb2_set_read_ahead().
+ *
+ * Returns
+ *    >=0 : Number of bytes read. This is short only at end of file.
+ * -errno : An error occurred.
+ */
+int smb2_pread_ahead(struct smb2_context *smb2, struct smb2fh *fh,
+                     uint8_t *buf, uint32_t count, uint64_t offset);
+
 /*
  * PWRITE
  */
@@ -909,6 +1091,55 @@ int smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
 int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
                 const uint8_t *buf, uint32_t count, uint64_t offset);
 
+/*
+ * Write-behind pwrite().
+ * The data is copied and sent in chunks, up to the write-behind window
+ * (see smb2_set_write_behind_window) of which may still be in flight
+ * when the function returns.
+ *
+ * Returns
+ *    >=0 : Number of bytes queued, always count.
+ * -errno : An error occurred, either for this call or for an earlier
+ *          write on the same filehandle that completed in the background.
+ *          The error is only reported once.
+ *
+ * smb2_close() waits for any writes still in flight before closing the
+ * file, but does not report their errors.
+ */
+int smb2_pwrite_behind(struct smb2_context *smb2, struct smb2fh *fh,
+                       const uint8_t *buf, uint32_t count, uint64_t offset);
+
+/*
+ * Wait for all writes queued by smb2_pwrite_behind() on this filehandle
+ * to complete.
+ *
+ * Returns
+ *      0 : All writes completed successfully.
+ * -errno : A background write failed, or we failed to wait for it.
+ */
+int smb2_write_behind_flush(struct smb2_context *smb2, struct smb2fh *fh);
+
+/*
+ * Wait for all writes queued by smb2_pwrite_behind() on this filehandle
+ * to complete without collecting their errors. An error stays with the
+ * filehandle until the next smb2_pwrite_behind() or
+ * smb2_write_behind_flush(). For reads and other operations that only
+ * need the data to have reached the server.
+ *
+ * Returns
+ *      0 : No writes are in flight any more.
+ * -errno : We failed to wait for them.
+ */
+int smb2_write_behind_wait(struct smb2_context *smb2, struct smb2fh *fh);
+
+/*
+ * Returns the number of writes queued by smb2_pwrite_behind() that are
+ * still in flight, summed over all filehandles. While it is not 0 the
+ * size and timestamps the server reports for a file that is being
+ * written may not include all of the data yet.
+ */
+int smb2_write_behind_pending(struct smb2_context *smb2);
+
 /*
  * READ
  */
@@ -1245,6 +1476,18 @@ free_smb2_file_notify_change_information(struct smb2_context *smb2, struct smb2_
 int smb2_notify_change_async(struct smb2_context *smb2, const char *path, uint16_t flags, uint32_t filter, int loop,
                        smb2_command_cb cb, void *cb_data);
 
+/*
+ * When the callback is invoked, status indicates the result:
+ *      0 : Something changed.
+ *          Command_data is struct smb2_file_notify_change_information,
+ *          which is freed using free_smb2_file_notify_change_information().
+ *          Its name is NULL if the server did not say what changed.
+ *          With loop set, the next notify request is sent after the
+ *          callback returns.
+ * -errno : The watch has ended, e.g. because the filehandle was closed
+ *          or, with loop set, the next notify request could not be sent.
+ *          Command_data is NULL.
+ */
 int smb2_notify_change_filehandle_async(struct smb2_context *smb2, struct smb2fh *smb2_dir_fh, uint16_t flags, uint32_t filter, int loop,
                        smb2_command_cb cb, void *cb_data);
 
@@ -24,6 +24,21 @@
 
 #include <stdint.h>
 
+#include <stddef.h>
+
+#define AES_BLOCK_SIZE 16
+
+/* Expanded encryption key for AES-128 or AES-256 */
+struct aes_key {
+        uint32_t rk[60];
+        int rounds;
+        int aesni;
+};
+
 void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
 
+/* Returns 0 on success or -1 if len is not 16 or 32 bytes */
+int AES_set_encrypt_key(struct aes_key *key, const uint8_t *userKey, size_t len);
+void AES_encrypt(const struct aes_key *key, const uint8_t *input, uint8_t *output);
+
 #endif
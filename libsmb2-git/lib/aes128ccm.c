@@ -62,7 +62,7 @@ static inline void bxory(unsigned char *b, unsigned char *y, size_t num)
         }
 }
 
-static void ccm_generate_T(unsigned char *key,
+static void ccm_generate_T(const struct aes_key *key,
                            unsigned char *nonce, size_t nlen,
                            unsigned char *aad, size_t alen,
                            unsigned char *p, size_t plen,
@@ -72,7 +72,7 @@ static void ccm_generate_T(unsigned char *key,
         uint16_t l;
 
         aes_ccm_generate_b0(nonce, nlen, alen, plen, mlen, &b[0]);
-        AES128_ECB_encrypt(b, key, y);
+        AES_encrypt(key, b, y);
 
         /* Create Aad */
         if (alen) {
@@ -87,7 +87,7 @@ static void ccm_generate_T(unsigned char *key,
                 alen -= l;
 
                 bxory(b, y, 16);
-                AES128_ECB_encrypt(b, key, y);
+                AES_encrypt(key, b, y);
 
                 while (alen) {
                         memset(b, 0, 16);
@@ -97,7 +97,7 @@ static void ccm_generate_T(unsigned char *key,
                         alen -= l;
 
                         bxory(b, y, 16);
-                        AES128_ECB_encrypt(b, key, y);
+                        AES_encrypt(key, b, y);
                 }
         }
 
@@ -110,13 +110,14 @@ static void ccm_generate_T(unsigned char *key,
                 plen -= l;
 
                 bxory(b, y, 16);
-                AES128_ECB_encrypt(b, key, y);
+                AES_encrypt(key, b, y);
         }
 
         memcpy(m, y, mlen);
 }
 
-static void ccm_generate_s(unsigned char *key, unsigned char *nonce, size_t nlen,
+static void ccm_generate_s(const struct aes_key *key,
+                           unsigned char *nonce, size_t nlen,
                            size_t plen, int i, unsigned char *s)
 {
         uint32_t l;
@@ -129,10 +130,10 @@ static void ccm_generate_s(unsigned char *key, unsigned char *nonce, size_t nlen
 
         memcpy(&s[1], nonce, nlen);
 
-        AES128_ECB_encrypt(s, key, s);
+        AES_encrypt(key, s, s);
 }
 
-static void aes_ccm_crypt(unsigned char *key,
+static void aes_ccm_crypt(const struct aes_key *key,
                           unsigned char *nonce, size_t nlen,
                           unsigned char *p, size_t plen)
 {
@@ -151,7 +152,7 @@ static void aes_ccm_crypt(unsigned char *key,
         }
 }
 
-void aes128ccm_encrypt(unsigned char *key,
+void aes128ccm_encrypt(const struct aes_key *key,
                        unsigned char *nonce, size_t nlen,
                        unsigned char *aad, size_t alen,
                        unsigned char *p, size_t plen,
@@ -166,7 +167,7 @@ void aes128ccm_encrypt(unsigned char *key,
         aes_ccm_crypt(key, nonce, nlen, p, plen);
 }
 
-int aes128ccm_decrypt(unsigned char *key,
+int aes128ccm_decrypt(const struct aes_key *key,
                       unsigned char *nonce, size_t nlen,
                       unsigned char *aad, size_t alen,
                       unsigned char *p, size_t plen,
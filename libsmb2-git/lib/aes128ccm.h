@@ -15,13 +15,16 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
-void aes128ccm_encrypt(unsigned char *key,
+struct aes_key;
+
+/* key is an expanded AES-128 key from AES_set_encrypt_key() */
+void aes128ccm_encrypt(const struct aes_key *key,
 		       unsigned char *nonce, size_t nlen,
 		       unsigned char *aad, size_t alen,
 		       unsigned char *p, size_t plen,
 		       unsigned char *m, size_t mlen);
 
-int aes128ccm_decrypt(unsigned char *key,
+int aes128ccm_decrypt(const struct aes_key *key,
 		      unsigned char *nonce, size_t nlen,
 		      unsigned char *aad, size_t alen,
 		      unsigned char *p, size_t plen,
@@ -0,0 +1,259 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the libsmb2 contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * AES-GCM as described in NIST SP 800-38D.
+ *
+ * GHASH uses Shoup's 4-bit table method: sixteen multiples of H are
+ * computed once per key, after which each block costs 32 table lookups
+ * and shifts instead of 128 conditional xors.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include <string.h>
+
+#include "compat.h"
+
+#include "aesgcm.h"
+
+static const uint64_t last4[16] = {
+        0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+        0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static inline uint64_t get_be64(const uint8_t *p)
+{
+        return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static inline void put_be64(uint8_t *p, uint64_t v)
+{
+        int i;
+
+        for (i = 7; i >= 0; i--) {
+                p[i] = v & 0xff;
+                v >>= 8;
+        }
+}
+
+int aes_gcm_init_key(struct aes_gcm_key *key, const uint8_t *k, size_t klen)
+{
+        uint8_t h[16];
+        uint64_t vh, vl;
+        uint32_t t;
+        int i, j;
+
+        if (AES_set_encrypt_key(&key->aes, k, klen)) {
+                return -1;
+        }
+
+        memset(h, 0, sizeof(h));
+        AES_encrypt(&key->aes, h, h);
+        vh = get_be64(&h[0]);
+        vl = get_be64(&h[8]);
+
+        /* hh/hl[i] hold H times the 4-bit value i, in GCM bit order */
+        key->hh[8] = vh;
+        key->hl[8] = vl;
+        key->hh[0] = 0;
+        key->hl[0] = 0;
+        for (i = 4; i > 0; i >>= 1) {
+                t = (uint32_t)(vl & 1) * 0xe1000000U;
+                vl = (vh << 63) | (vl >> 1);
+                vh = (vh >> 1) ^ ((uint64_t)t << 32);
+                key->hh[i] = vh;
+                key->hl[i] = vl;
+        }
+        for (i = 2; i <= 8; i *= 2) {
+                for (j = 1; j < i; j++) {
+                        key->hh[i + j] = key->hh[i] ^ key->hh[j];
+                        key->hl[i + j] = key->hl[i] ^ key->hl[j];
+                }
+        }
+
+        return 0;
+}
+
+/* x = x * H */
+static void gcm_mult(const struct aes_gcm_key *key, uint8_t *x)
+{
+        uint64_t zh, zl;
+        uint8_t lo, hi, rem;
+        int i;
+
+        lo = x[15] & 0x0f;
+        zh = key->hh[lo];
+        zl = key->hl[lo];
+
+        for (i = 15; i >= 0; i--) {
+                lo = x[i] & 0x0f;
+                hi = (x[i] >> 4) & 0x0f;
+
+                if (i != 15) {
+                        rem = (uint8_t)(zl & 0x0f);
+                        zl = (zh << 60) | (zl >> 4);
+                        zh = (zh >> 4) ^ (last4[rem] << 48);
+                        zh ^= key->hh[lo];
+                        zl ^= key->hl[lo];
+                }
+                rem = (uint8_t)(zl & 0x0f);
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ (last4[rem] << 48);
+                zh ^= key->hh[hi];
+                zl ^= key->hl[hi];
+        }
+
+        put_be64(&x[0], zh);
+        put_be64(&x[8], zl);
+}
+
+static inline void gcm_incr(uint8_t *ctr)
+{
+        int i;
+
+        for (i = 15; i >= 12; i--) {
+                if (++ctr[i] != 0) {
+                        break;
+                }
+        }
+}
+
+void aes_gcm_start(struct aes_gcm_ctx *ctx, const struct aes_gcm_key *key,
+                   int decrypt, const uint8_t *nonce,
+                   const uint8_t *aad, size_t alen)
+{
+        size_t i, n;
+
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->key = key;
+        ctx->decrypt = decrypt;
+        ctx->alen = alen;
+
+        memcpy(ctx->j0, nonce, AES_GCM_NONCE_SIZE);
+        ctx->j0[15] = 1;
+        memcpy(ctx->ctr, ctx->j0, 16);
+
+        while (alen) {
+                n = alen < 16 ? alen : 16;
+                for (i = 0; i < n; i++) {
+                        ctx->x[i] ^= aad[i];
+                }
+                gcm_mult(key, ctx->x);
+                aad += n;
+                alen -= n;
+        }
+}
+
+void aes_gcm_update(struct aes_gcm_ctx *ctx, const uint8_t *in,
+                    uint8_t *out, size_t len)
+{
+        const struct aes_gcm_key *key = ctx->key;
+        unsigned int pos = ctx->len & 0x0f;
+        uint8_t c;
+        size_t i;
+
+        ctx->len += len;
+
+        /* finish a block left partial by the previous call */
+        while (pos && len) {
+                c = ctx->decrypt ? *in : *in ^ ctx->ks[pos];
+                *out = *in ^ ctx->ks[pos];
+                ctx->x[pos] ^= c;
+                in++;
+                out++;
+                len--;
+                pos = (pos + 1) & 0x0f;
+                if (pos == 0) {
+                        gcm_mult(key, ctx->x);
+                }
+        }
+
+        while (len >= 16) {
+                gcm_incr(ctx->ctr);
+                AES_encrypt(&key->aes, ctx->ctr, ctx->ks);
+                if (ctx->decrypt) {
+                        for (i = 0; i < 16; i++) {
+                                ctx->x[i] ^= in[i];
+                                out[i] = in[i] ^ ctx->ks[i];
+                        }
+                } else {
+                        for (i = 0; i < 16; i++) {
+                                out[i] = in[i] ^ ctx->ks[i];
+                                ctx->x[i] ^= out[i];
+                        }
+                }
+                gcm_mult(key, ctx->x);
+                in += 16;
+                out += 16;
+                len -= 16;
+        }
+
+        if (len) {
+                gcm_incr(ctx->ctr);
+                AES_encrypt(&key->aes, ctx->ctr, ctx->ks);
+                for (i = 0; i < len; i++) {
+                        c = ctx->decrypt ? in[i] : in[i] ^ ctx->ks[i];
+                        out[i] = in[i] ^ ctx->ks[i];
+                        ctx->x[i] ^= c;
+                }
+        }
+}
+
+void aes_gcm_finish(struct aes_gcm_ctx *ctx, uint8_t *tag)
+{
+        uint8_t lens[16];
+        int i;
+
+        if (ctx->len & 0x0f) {
+                gcm_mult(ctx->key, ctx->x);
+        }
+
+        put_be64(&lens[0], ctx->alen * 8);
+        put_be64(&lens[8], ctx->len * 8);
+        for (i = 0; i < 16; i++) {
+                ctx->x[i] ^= lens[i];
+        }
+        gcm_mult(ctx->key, ctx->x);
+
+        AES_encrypt(&ctx->key->aes, ctx->j0, tag);
+        for (i = 0; i < 16; i++) {
+                tag[i] ^= ctx->x[i];
+        }
+}
+
+int aes_gcm_check_tag(struct aes_gcm_ctx *ctx, const uint8_t *tag)
+{
+        uint8_t computed[AES_GCM_TAG_SIZE];
+        uint8_t diff = 0;
+        int i;
+
+        aes_gcm_finish(ctx, computed);
+        for (i = 0; i < AES_GCM_TAG_SIZE; i++) {
+                diff |= computed[i] ^ tag[i];
+        }
+
+        return diff ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the libsmb2 contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _AESGCM_H_
+#define _AESGCM_H_
+
+#include "aes.h"
+
+#define AES_GCM_NONCE_SIZE 12
+#define AES_GCM_TAG_SIZE   16
+
+/*
+ * Per-key state: the expanded AES key and the 4-bit multiplication
+ * tables for the hash subkey H. Set up once per session key.
+ */
+struct aes_gcm_key {
+        struct aes_key aes;
+        uint64_t hl[16];
+        uint64_t hh[16];
+};
+
+/*
+ * Per-message state. Data is passed through aes_gcm_update() in
+ * as many pieces as the caller likes. in and out may be the same
+ * buffer for in-place operation.
+ */
+struct aes_gcm_ctx {
+        const struct aes_gcm_key *key;
+        uint8_t j0[16];
+        uint8_t ctr[16];
+        uint8_t ks[16];
+        uint8_t x[16];
+        uint64_t alen;
+        uint64_t len;
+        int decrypt;
+};
+
+int aes_gcm_init_key(struct aes_gcm_key *key, const uint8_t *k, size_t klen);
+
+void aes_gcm_start(struct aes_gcm_ctx *ctx, const struct aes_gcm_key *key,
+                   int decrypt, const uint8_t *nonce,
+                   const uint8_t *aad, size_t alen);
+void aes_gcm_update(struct aes_gcm_ctx *ctx, const uint8_t *in,
+                    uint8_t *out, size_t len);
+void aes_gcm_finish(struct aes_gcm_ctx *ctx, uint8_t *tag);
+
+/* Constant time compare of the computed tag with the received one.
+ * Returns 0 if they match. */
+int aes_gcm_check_tag(struct aes_gcm_ctx *ctx, const uint8_t *tag);
+
+#endif /* !_AESGCM_H_ */
@@ -0,0 +1,356 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the libsmb2 contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * HMAC-SHA256 (RFC 2104, FIPS 180-4) for SMB 2.x signing.
+ *
+ * Unlike the generic RFC 4634 code in hmac.c/sha224-256.c this hashes
+ * whole blocks straight from the caller's buffer, keeps the padded key
+ * blocks pre-hashed per key, and on x86 uses the SHA extensions when
+ * the CPU has them.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "hmac-sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+        0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+        0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+        0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define GETU32(p) (((uint32_t)(p)[0] << 24) ^ ((uint32_t)(p)[1] << 16) ^ \
+                   ((uint32_t)(p)[2] <<  8) ^ ((uint32_t)(p)[3]))
+#define PUTU32(p, v) do { (p)[0] = (uint8_t)((v) >> 24); \
+                          (p)[1] = (uint8_t)((v) >> 16); \
+                          (p)[2] = (uint8_t)((v) >>  8); \
+                          (p)[3] = (uint8_t)(v); } while (0)
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define S0(x) (ROR32(x,  2) ^ ROR32(x, 13) ^ ROR32(x, 22))
+#define S1(x) (ROR32(x,  6) ^ ROR32(x, 11) ^ ROR32(x, 25))
+#define s0(x) (ROR32(x,  7) ^ ROR32(x, 18) ^ ((x) >>  3))
+#define s1(x) (ROR32(x, 17) ^ ROR32(x, 19) ^ ((x) >> 10))
+
+#define CH(x, y, z)  (((x) & ((y) ^ (z))) ^ (z))
+#define MAJ(x, y, z) (((x) & ((y) | (z))) | ((y) & (z)))
+
+/* The message schedule is kept as a 16 word ring instead of 64 words */
+#define W(i) w[(i) & 15]
+#define SCHED(i) (W(i) += s1(W((i) - 2)) + W((i) - 7) + s0(W((i) - 15)))
+
+/* One round. Instead of shuffling the eight working variables around
+ * the caller rotates the argument order. */
+#define ROUND(a, b, c, d, e, f, g, h, i, x) do {                        \
+                t = h + S1(e) + CH(e, f, g) + K[i] + (x);               \
+                d += t;                                                 \
+                h = t + S0(a) + MAJ(a, b, c);                           \
+        } while (0)
+
+static void
+sha256_blocks_generic(uint32_t *state, const uint8_t *p, size_t nblocks)
+{
+        uint32_t a, b, c, d, e, f, g, h, t;
+        uint32_t w[16];
+        int i;
+
+        while (nblocks--) {
+                a = state[0]; b = state[1]; c = state[2]; d = state[3];
+                e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+                for (i = 0; i < 16; i += 8) {
+                        W(i + 0) = GETU32(p + 4 * (i + 0));
+                        W(i + 1) = GETU32(p + 4 * (i + 1));
+                        W(i + 2) = GETU32(p + 4 * (i + 2));
+                        W(i + 3) = GETU32(p + 4 * (i + 3));
+                        W(i + 4) = GETU32(p + 4 * (i + 4));
+                        W(i + 5) = GETU32(p + 4 * (i + 5));
+                        W(i + 6) = GETU32(p + 4 * (i + 6));
+                        W(i + 7) = GETU32(p + 4 * (i + 7));
+                        ROUND(a, b, c, d, e, f, g, h, i + 0, W(i + 0));
+                        ROUND(h, a, b, c, d, e, f, g, i + 1, W(i + 1));
+                        ROUND(g, h, a, b, c, d, e, f, i + 2, W(i + 2));
+                        ROUND(f, g, h, a, b, c, d, e, i + 3, W(i + 3));
+                        ROUND(e, f, g, h, a, b, c, d, i + 4, W(i + 4));
+                        ROUND(d, e, f, g, h, a, b, c, i + 5, W(i + 5));
+                        ROUND(c, d, e, f, g, h, a, b, i + 6, W(i + 6));
+                        ROUND(b, c, d, e, f, g, h, a, i + 7, W(i + 7));
+                }
+                for (; i < 64; i += 8) {
+                        ROUND(a, b, c, d, e, f, g, h, i + 0, SCHED(i + 0));
+                        ROUND(h, a, b, c, d, e, f, g, i + 1, SCHED(i + 1));
+                        ROUND(g, h, a, b, c, d, e, f, i + 2, SCHED(i + 2));
+                        ROUND(f, g, h, a, b, c, d, e, i + 3, SCHED(i + 3));
+                        ROUND(e, f, g, h, a, b, c, d, i + 4, SCHED(i + 4));
+                        ROUND(d, e, f, g, h, a, b, c, i + 5, SCHED(i + 5));
+                        ROUND(c, d, e, f, g, h, a, b, i + 6, SCHED(i + 6));
+                        ROUND(b, c, d, e, f, g, h, a, i + 7, SCHED(i + 7));
+                }
+
+                state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+                state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+                p += HMAC_SHA256_BLOCK_SIZE;
+        }
+}
+
+#ifdef HAVE_SHANI
+static int shani_available(void)
+{
+        static int available = -1;
+        unsigned int eax, ebx, ecx, edx;
+
+        if (available < 0) {
+                available = 0;
+                if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+                    (ecx & bit_SSE4_1) && (ecx & bit_SSSE3) &&
+                    __get_cpuid_max(0, NULL) >= 7) {
+                        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+                        /* CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29] */
+                        available = (ebx & (1U << 29)) != 0;
+                }
+        }
+        return available;
+}
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_shani(uint32_t *state, const uint8_t *p, size_t nblocks)
+{
+        const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                             0x0405060700010203ULL);
+        __m128i abef, cdgh, abef_save, cdgh_save, msg, tmp;
+        __m128i w[4];
+        int i;
+
+        /* the sha256rnds2 instruction wants the state as ABEF/CDGH */
+        tmp = _mm_loadu_si128((const __m128i *)(const void *)&state[0]);
+        cdgh = _mm_loadu_si128((const __m128i *)(const void *)&state[4]);
+        tmp = _mm_shuffle_epi32(tmp, 0xb1);
+        cdgh = _mm_shuffle_epi32(cdgh, 0x1b);
+        abef = _mm_alignr_epi8(tmp, cdgh, 8);
+        cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+        while (nblocks--) {
+                abef_save = abef;
+                cdgh_save = cdgh;
+
+                for (i = 0; i < 16; i++) {
+                        if (i < 4) {
+                                msg = _mm_loadu_si128((const __m128i *)
+                                                      (const void *)(p + 16 * i));
+                                w[i] = _mm_shuffle_epi8(msg, bswap);
+                        } else {
+                                tmp = _mm_sha256msg1_epu32(w[i & 3],
+                                                           w[(i - 3) & 3]);
+                                tmp = _mm_add_epi32(tmp,
+                                        _mm_alignr_epi8(w[(i - 1) & 3],
+                                                        w[(i - 2) & 3], 4));
+                                w[i & 3] = _mm_sha256msg2_epu32(tmp,
+                                                        w[(i - 1) & 3]);
+                        }
+                        msg = _mm_add_epi32(w[i & 3],
+                                _mm_loadu_si128((const __m128i *)
+                                                (const void *)&K[4 * i]));
+                        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+                        msg = _mm_shuffle_epi32(msg, 0x0e);
+                        abef = _mm_sha256rnds2_epu32(abef, cdgh, msg);
+                }
+
+                abef = _mm_add_epi32(abef, abef_save);
+                cdgh = _mm_add_epi32(cdgh, cdgh_save);
+                p += HMAC_SHA256_BLOCK_SIZE;
+        }
+
+        tmp = _mm_shuffle_epi32(abef, 0x1b);
+        cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+        abef = _mm_blend_epi16(tmp, cdgh, 0xf0);
+        cdgh = _mm_alignr_epi8(cdgh, tmp, 8);
+        _mm_storeu_si128((__m128i *)(void *)&state[0], abef);
+        _mm_storeu_si128((__m128i *)(void *)&state[4], cdgh);
+}
+#endif
+
+static void
+sha256_blocks(uint32_t *state, const uint8_t *p, size_t nblocks)
+{
+#ifdef HAVE_SHANI
+        if (shani_available()) {
+                sha256_blocks_shani(state, p, nblocks);
+                return;
+        }
+#endif
+        sha256_blocks_generic(state, p, nblocks);
+}
+
+static void
+sha256_update(struct sha256_state *st, const uint8_t *data, size_t len)
+{
+        size_t n;
+
+        st->len += len;
+
+        if (st->buf_len) {
+                n = HMAC_SHA256_BLOCK_SIZE - st->buf_len;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(&st->buf[st->buf_len], data, n);
+                st->buf_len += n;
+                data += n;
+                len -= n;
+                if (st->buf_len < HMAC_SHA256_BLOCK_SIZE) {
+                        return;
+                }
+                sha256_blocks(st->h, st->buf, 1);
+                st->buf_len = 0;
+        }
+
+        n = len / HMAC_SHA256_BLOCK_SIZE;
+        if (n) {
+                sha256_blocks(st->h, data, n);
+                data += n * HMAC_SHA256_BLOCK_SIZE;
+                len -= n * HMAC_SHA256_BLOCK_SIZE;
+        }
+
+        if (len) {
+                memcpy(st->buf, data, len);
+                st->buf_len = len;
+        }
+}
+
+static void
+sha256_final(struct sha256_state *st, uint8_t *digest)
+{
+        uint64_t bits = st->len * 8;
+        int i;
+
+        st->buf[st->buf_len++] = 0x80;
+        if (st->buf_len > HMAC_SHA256_BLOCK_SIZE - 8) {
+                memset(&st->buf[st->buf_len], 0,
+                       HMAC_SHA256_BLOCK_SIZE - st->buf_len);
+                sha256_blocks(st->h, st->buf, 1);
+                st->buf_len = 0;
+        }
+        memset(&st->buf[st->buf_len], 0,
+               HMAC_SHA256_BLOCK_SIZE - 8 - st->buf_len);
+        PUTU32(&st->buf[56], (uint32_t)(bits >> 32));
+        PUTU32(&st->buf[60], (uint32_t)bits);
+        sha256_blocks(st->h, st->buf, 1);
+
+        for (i = 0; i < 8; i++) {
+                PUTU32(&digest[4 * i], st->h[i]);
+        }
+}
+
+void
+hmac_sha256_init_key(struct hmac_sha256_key *key,
+                     const uint8_t *k, size_t klen)
+{
+        uint8_t tk[HMAC_SHA256_DIGEST_SIZE];
+        uint8_t pad[HMAC_SHA256_BLOCK_SIZE];
+        struct sha256_state st;
+        size_t i;
+
+        /* keys longer than a block are replaced by their hash */
+        if (klen > HMAC_SHA256_BLOCK_SIZE) {
+                memcpy(st.h, H0, sizeof(H0));
+                st.buf_len = 0;
+                st.len = 0;
+                sha256_update(&st, k, klen);
+                sha256_final(&st, tk);
+                k = tk;
+                klen = sizeof(tk);
+        }
+
+        memset(pad, 0x36, sizeof(pad));
+        for (i = 0; i < klen; i++) {
+                pad[i] ^= k[i];
+        }
+        memcpy(key->inner, H0, sizeof(H0));
+        sha256_blocks(key->inner, pad, 1);
+
+        memset(pad, 0x5c, sizeof(pad));
+        for (i = 0; i < klen; i++) {
+                pad[i] ^= k[i];
+        }
+        memcpy(key->outer, H0, sizeof(H0));
+        sha256_blocks(key->outer, pad, 1);
+
+        memset(pad, 0, sizeof(pad));
+        memset(tk, 0, sizeof(tk));
+}
+
+void
+hmac_sha256_start(struct hmac_sha256_ctx *ctx,
+                  const struct hmac_sha256_key *key)
+{
+        ctx->key = key;
+        memcpy(ctx->st.h, key->inner, sizeof(key->inner));
+        ctx->st.buf_len = 0;
+        ctx->st.len = HMAC_SHA256_BLOCK_SIZE;
+}
+
+void
+hmac_sha256_update(struct hmac_sha256_ctx *ctx,
+                   const uint8_t *data, size_t len)
+{
+        sha256_update(&ctx->st, data, len);
+}
+
+void
+hmac_sha256_finish(struct hmac_sha256_ctx *ctx,
+                   uint8_t mac[HMAC_SHA256_DIGEST_SIZE])
+{
+        uint8_t ih[HMAC_SHA256_DIGEST_SIZE];
+
+        sha256_final(&ctx->st, ih);
+
+        memcpy(ctx->st.h, ctx->key->outer, sizeof(ctx->key->outer));
+        ctx->st.buf_len = 0;
+        ctx->st.len = HMAC_SHA256_BLOCK_SIZE;
+        sha256_update(&ctx->st, ih, sizeof(ih));
+        sha256_final(&ctx->st, mac);
+}
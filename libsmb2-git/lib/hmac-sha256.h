@@ -0,0 +1,65 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the libsmb2 contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HMAC_SHA256_H_
+#define _HMAC_SHA256_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HMAC_SHA256_BLOCK_SIZE  64
+#define HMAC_SHA256_DIGEST_SIZE 32
+
+/*
+ * Per-key state: the SHA-256 chaining values after the K^ipad and
+ * K^opad blocks. Set up once per key, after which each MAC costs
+ * only the compressions for the message itself plus one for the
+ * outer hash.
+ */
+struct hmac_sha256_key {
+        uint32_t inner[8];
+        uint32_t outer[8];
+};
+
+struct sha256_state {
+        uint32_t h[8];
+        uint8_t buf[HMAC_SHA256_BLOCK_SIZE];
+        size_t buf_len;
+        uint64_t len;
+};
+
+/* Per-message state. Data can be fed in any number of pieces. */
+struct hmac_sha256_ctx {
+        const struct hmac_sha256_key *key;
+        struct sha256_state st;
+};
+
+void hmac_sha256_init_key(struct hmac_sha256_key *key,
+                          const uint8_t *k, size_t klen);
+
+void hmac_sha256_start(struct hmac_sha256_ctx *ctx,
+                       const struct hmac_sha256_key *key);
+void hmac_sha256_update(struct hmac_sha256_ctx *ctx,
+                        const uint8_t *data, size_t len);
+void hmac_sha256_finish(struct hmac_sha256_ctx *ctx,
+                        uint8_t mac[HMAC_SHA256_DIGEST_SIZE]);
+
+#endif /* !_HMAC_SHA256_H_ */
@@ -74,6 +74,8 @@
 #include "libsmb2.h"
 #include "libsmb2-private.h"
 #include "slist.h"
+#include "smb2-signing.h"
+#include "smb3-seal.h"
 
 #define MAX_URL_SIZE 1024
 
@@ -350,10 +352,12 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 }
                 smb2_free_pdu(smb2, smb2->pdu);
         }
-        while (smb2->waitqueue) {
-                struct smb2_pdu *pdu = smb2->waitqueue;
+        for (;;) {
+                struct smb2_pdu *pdu = smb2_waitqueue_pop(smb2);
 
-                smb2->waitqueue = pdu->next;
+                if (pdu == NULL) {
+                        break;
+                }
                 if (pdu->cb) {
                         pdu->cb(smb2, SMB2_STATUS_SHUTDOWN, NULL, pdu->cb_data);
                 }
@@ -378,6 +382,8 @@ void smb2_destroy_context(struct smb2_context *smb2)
         }
         free(smb2->session_key);
         smb2->session_key = NULL;
+        smb3_free_cipher_keys(smb2);
+        smb2_free_signing_ctx(smb2);
 
         free(discard_const(smb2->user));
         free(discard_const(smb2->server));
@@ -385,7 +391,7 @@ void smb2_destroy_context(struct smb2_context *smb2)
         free(discard_const(smb2->password));
         free(discard_const(smb2->domain));
         free(discard_const(smb2->workstation));
-        free(smb2->enc);
+        smb3_free_buffers(smb2);
 
 #ifdef HAVE_LIBKRB5
         if (smb2->cred_handle) {
@@ -398,6 +404,9 @@ void smb2_destroy_context(struct smb2_context *smb2)
             free_c_data(smb2, smb2->connect_data);  /* sets smb2->connect_data to NULL */
         }
 
+        smb2_free_pdu_pool(smb2);
+        free(smb2->trace);
+
         SMB2_LIST_REMOVE(&active_contexts, smb2);
         free(smb2);
 }
@@ -731,6 +740,58 @@ void smb2_set_timeout(struct smb2_context *smb2, int seconds)
         smb2->timeout = seconds;
 }
 
+void smb2_set_write_behind_window(struct smb2_context *smb2, uint32_t bytes)
+{
+        smb2->write_behind_window = bytes;
+}
+
+void smb2_set_read_ahead(struct smb2_context *smb2, int max_chunks)
+{
+        if (max_chunks < 0) {
+                max_chunks = 0;
+        }
+        smb2->read_ahead_max = max_chunks;
+}
+
+void smb2_set_dir_buffer_size(struct smb2_context *smb2, uint32_t size)
+{
+        smb2->dir_buffer_size = size;
+}
+
+void smb2_set_sync_stats(struct smb2_context *smb2, int enable)
+{
+        smb2->sync_stats.enabled = enable;
+}
+
+int smb2_set_trace_size(struct smb2_context *smb2, uint32_t nrecords)
+{
+        struct smb2_trace *trace = NULL;
+        uint32_t n = 1;
+
+        if (nrecords) {
+                while (n < nrecords && n < SMB2_TRACE_MAX_RECORDS) {
+                        n <<= 1;
+                }
+                trace = calloc(1, sizeof(*trace) +
+                               n * sizeof(struct smb2_trace_rec));
+                if (trace == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate trace "
+                                       "buffer");
+                        return -ENOMEM;
+                }
+                trace->mask = n - 1;
+        }
+
+        /* continue the sequence so pdus still in flight can not be
+         * matched to records of the new buffer */
+        if (trace && smb2->trace) {
+                trace->seq = smb2->trace->seq;
+        }
+        free(smb2->trace);
+        smb2->trace = trace;
+        return 0;
+}
+
 void smb2_set_version(struct smb2_context *smb2,
                       enum smb2_negotiate_version version)
 {
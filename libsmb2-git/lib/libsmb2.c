@@ -103,6 +103,7 @@
 #include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 #include "smb2-signing.h"
+#include "smb3-seal.h"
 #include "portable-endian.h"
 #include "ntlmssp.h"
 
@@ -166,6 +167,10 @@ struct smb2fh {
         smb2_file_id file_id;
         int64_t offset;
         int64_t end_of_file;
+
+        struct smb2_write_behind wb;
+        struct smb2_read_ahead ra;
+        struct smb2_pread_pipeline pp;
 };
 
 void
@@ -189,6 +194,8 @@ smb2_close_context(struct smb2_context *smb2)
         smb2->tree_id_cur = 0;
         smb2->tree_id[0] = 0xdeadbeef;
         memset(smb2->signing_key, 0, SMB2_KEY_SIZE);
+        smb2_free_signing_ctx(smb2);
+        smb3_free_cipher_keys(smb2);
         if (smb2->session_key) {
                 free(smb2->session_key);
                 smb2->session_key = NULL;
@@ -201,17 +208,96 @@ send_session_setup_request(struct smb2_context *smb2,
                            struct connect_data *c_data,
                            unsigned char *buf, int len);
 
+/*
+ * Output buffer length for QUERY_DIRECTORY requests. Anything above 64kb
+ * needs multi-credit, so stay within what the server allows and what the
+ * credits we hold can pay for.
+ */
+static uint32_t
+dir_buffer_length(struct smb2_context *smb2)
+{
+        uint32_t len = smb2->dir_buffer_size;
+        uint32_t max_credit_len;
+
+        if (len == 0) {
+                return DEFAULT_OUTPUT_BUFFER_LENGTH;
+        }
+        if (!smb2->supports_multi_credit) {
+                max_credit_len = 65536;
+        } else if (smb2->credits > 1) {
+                max_credit_len = (uint32_t)smb2->credits * 65536;
+        } else {
+                max_credit_len = 65536;
+        }
+        if (len > max_credit_len) {
+                len = max_credit_len;
+        }
+        if (smb2->max_transact_size && len > smb2->max_transact_size) {
+                len = smb2->max_transact_size;
+        }
+        return len;
+}
+
+/* Chunk data starts after the header, rounded up so that the 64 bit
+ * members of the entries are aligned.
+ */
+#define DIRENT_CHUNK_HDR ((sizeof(struct smb2_dirent_chunk) + 7) & ~(size_t)7)
+
+/*
+ * Bump allocate len bytes from the chunks of the directory. Entries
+ * and names are never freed one by one, only all at once by
+ * free_dirents().
+ */
+static void *
+dirent_alloc(struct smb2dir *dir, size_t len)
+{
+        struct smb2_dirent_chunk *chunk = dir->chunks;
+        size_t size;
+        void *ptr;
+
+        len = (len + 7) & ~(size_t)7;
+        if (chunk == NULL || chunk->size - chunk->used < len) {
+                size = len > SMB2_DIRENT_CHUNK_SIZE ? len : SMB2_DIRENT_CHUNK_SIZE;
+                chunk = malloc(DIRENT_CHUNK_HDR + size);
+                if (chunk == NULL) {
+                        return NULL;
+                }
+                chunk->size = size;
+                chunk->used = 0;
+                chunk->next = dir->chunks;
+                dir->chunks = chunk;
+        }
+        ptr = (char *)chunk + DIRENT_CHUNK_HDR + chunk->used;
+        chunk->used += len;
+
+        return ptr;
+}
+
 static void
-free_smb2dir(struct smb2_context *smb2, struct smb2dir *dir)
+free_dirents(struct smb2dir *dir)
 {
-        SMB2_LIST_REMOVE(&smb2->dirs, dir);
-        while (dir->entries) {
-                struct smb2_dirent_internal *e = dir->entries->next;
+        struct smb2_dirent_chunk *chunk;
 
-                free(discard_const(dir->entries->dirent.name));
-                free(dir->entries);
-                dir->entries = e;
+        /* One chunk is kept for the next batch of a streamed directory */
+        while (dir->chunks && dir->chunks->next) {
+                chunk = dir->chunks->next;
+                dir->chunks->next = chunk->next;
+                free(chunk);
+        }
+        if (dir->chunks) {
+                dir->chunks->used = 0;
         }
+        dir->entries = NULL;
+        dir->last_entry = NULL;
+        dir->current_entry = NULL;
+}
+
+static void
+free_smb2dir(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        SMB2_LIST_REMOVE(&smb2->dirs, dir);
+        free_dirents(dir);
+        free(dir->chunks);
         if (dir->free_cb_data) {
                 dir->free_cb_data(dir->cb_data);
         }
@@ -232,6 +318,23 @@ smb2_seekdir(struct smb2_context *smb2, struct smb2dir *dir,
         if (dir == NULL){
                 return;
         }
+        if (dir->streaming) {
+                /* Only the current batch is buffered. Seeking backwards
+                 * past it restarts the scan on the server.
+                 */
+                if (loc < dir->base_index) {
+                        if (smb2_fetch_dirents(smb2, dir,
+                                               SMB2_RESTART_SCANS) < 0) {
+                                return;
+                        }
+                } else {
+                        dir->current_entry = dir->entries;
+                        dir->index = dir->base_index;
+                }
+                while (dir->index < loc && smb2_readdir(smb2, dir) != NULL) {
+                }
+                return;
+        }
         dir->current_entry = dir->entries;
         dir->index = 0;
 
@@ -257,6 +360,10 @@ smb2_rewinddir(struct smb2_context *smb2,
         if (dir == NULL) {
                 return;
         }
+        if (dir->streaming && dir->base_index > 0) {
+                smb2_fetch_dirents(smb2, dir, SMB2_RESTART_SCANS);
+                return;
+        }
         dir->current_entry = dir->entries;
         dir->index = 0;
 }
@@ -266,7 +373,16 @@ smb2_readdir(struct smb2_context *smb2,
              struct smb2dir *dir)
 {
         struct smb2dirent *ent;
-        if ((dir == NULL) || (dir->current_entry == NULL)) {
+        if (dir == NULL) {
+                return NULL;
+        }
+        if (dir->current_entry == NULL && dir->streaming &&
+            !dir->eof && dir->status == 0) {
+                if (smb2_fetch_dirents(smb2, dir, 0) < 0) {
+                        return NULL;
+                }
+        }
+        if (dir->current_entry == NULL) {
                 return NULL;
         }
 
@@ -277,12 +393,51 @@ smb2_readdir(struct smb2_context *smb2,
         return ent;
 }
 
+int
+smb2_readdir_status(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        if (dir == NULL) {
+                return -EINVAL;
+        }
+        return dir->status;
+}
+
+static void
+dir_close_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *private_data)
+{
+}
+
+static void
+dir_close_handle(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        struct smb2_close_request req;
+        struct smb2_pdu *pdu;
+
+        memset(&req, 0, sizeof(struct smb2_close_request));
+        memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
+
+        pdu = smb2_cmd_close_async(smb2, &req, dir_close_cb, NULL);
+        if (pdu == NULL) {
+                return;
+        }
+        smb2_queue_pdu(smb2, pdu);
+}
+
 void
 smb2_closedir(struct smb2_context *smb2, struct smb2dir *dir)
 {
         if ((smb2 == NULL) || (dir == NULL)) {
                 return;
         }
+        if (dir->fetching) {
+                /* freed once the outstanding query completes */
+                dir->closing = 1;
+                return;
+        }
+        if (dir->streaming) {
+                dir_close_handle(smb2, dir);
+        }
         free_smb2dir(smb2, dir);
 }
 
@@ -292,7 +447,10 @@ decode_dirents(struct smb2_context *smb2, struct smb2dir *dir,
 {
         struct smb2_dirent_internal *ent;
         struct smb2_fileidfulldirectoryinformation fs;
+        const uint16_t *name;
         uint32_t offset = 0;
+        uint32_t name_len;
+        size_t utf8_len;
 
         do {
                 struct smb2_iovec tmp_vec _U_;
@@ -303,22 +461,36 @@ decode_dirents(struct smb2_context *smb2, struct smb2dir *dir,
                         return -1;
                 }
 
-                ent = calloc(1, sizeof(struct smb2_dirent_internal));
+                tmp_vec.buf = &vec->buf[offset];
+                tmp_vec.len = vec->len - offset;
+
+                if (smb2_decode_fileidfulldirectoryinformation_fields(
+                            smb2, &fs, &tmp_vec, &name_len) < 0) {
+                        return -1;
+                }
+
+                /* The entry and its name are allocated back to back */
+                name = (const uint16_t *)(void *)&tmp_vec.buf[80];
+                utf8_len = smb2_utf16_utf8_size(name, name_len / 2);
+                ent = dirent_alloc(dir, sizeof(struct smb2_dirent_internal) +
+                                   utf8_len + 1);
                 if (ent == NULL) {
                         smb2_set_error(smb2, "Failed to allocate "
                                        "dirent_internal");
                         return -1;
                 }
-                SMB2_LIST_ADD(&dir->entries, ent);
-
+                memset(ent, 0, sizeof(struct smb2_dirent_internal));
+                smb2_utf16_to_utf8_buf(name, name_len / 2, (char *)(ent + 1));
+                ent->dirent.name = (const char *)(ent + 1);
 
-                tmp_vec.buf = &vec->buf[offset];
-                tmp_vec.len = vec->len - offset;
+                /* keep entries in the order the server sent them */
+                if (dir->last_entry) {
+                        dir->last_entry->next = ent;
+                } else {
+                        dir->entries = ent;
+                }
+                dir->last_entry = ent;
 
-                smb2_decode_fileidfulldirectoryinformation(smb2, &fs,
-                                                           &tmp_vec);
-                /* steal the name */
-                ent->dirent.name = fs.name;
                 ent->dirent.st.smb2_type = SMB2_TYPE_FILE;
                 if (fs.file_attributes & SMB2_FILE_ATTRIBUTE_DIRECTORY) {
                         ent->dirent.st.smb2_type = SMB2_TYPE_DIRECTORY;
@@ -385,12 +557,23 @@ query_cb(struct smb2_context *smb2, int status,
                         return;
                 }
 
+                if (dir->streaming) {
+                        /* Hand out the first batch right away, the rest
+                         * is fetched by smb2_readdir() as it is needed.
+                         */
+                        dir->current_entry = dir->entries;
+                        dir->index = 0;
+                        dir->base_index = 0;
+                        dir->cb(smb2, 0, dir, dir->cb_data);
+                        return;
+                }
+
                 /* We need to get more data */
                 memset(&req, 0, sizeof(struct smb2_query_directory_request));
                 req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
                 req.flags = 0;
                 memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
-                req.output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
+                req.output_buffer_length = dir_buffer_length(smb2);
                 req.name = "*";
 
                 pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
@@ -409,6 +592,7 @@ query_cb(struct smb2_context *smb2, int status,
                 struct smb2_pdu *pdu;
 
                 /* We have all the data */
+                dir->streaming = 0;
                 memset(&req, 0, sizeof(struct smb2_close_request));
                 req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
                 memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
@@ -454,7 +638,7 @@ opendir_cb(struct smb2_context *smb2, int status,
         req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
         req.flags = 0;
         memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
-        req.output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
+        req.output_buffer_length = dir_buffer_length(smb2);
         req.name = "*";
 
         pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
@@ -467,9 +651,90 @@ opendir_cb(struct smb2_context *smb2, int status,
         smb2_queue_pdu(smb2, pdu);
 }
 
+static void
+query_dirents_cb(struct smb2_context *smb2, int status,
+                 void *command_data, void *private_data)
+{
+        struct smb2dir *dir = private_data;
+        struct smb2_query_directory_reply *rep = command_data;
+
+        dir->fetching = 0;
+        if (dir->closing) {
+                if (status != SMB2_STATUS_SHUTDOWN) {
+                        dir_close_handle(smb2, dir);
+                }
+                free_smb2dir(smb2, dir);
+                return;
+        }
+
+        free_dirents(dir);
+        dir->index = dir->base_index;
+
+        if (status == SMB2_STATUS_SUCCESS) {
+                struct smb2_iovec vec _U_;
+
+                vec.buf = rep->output_buffer;
+                vec.len = rep->output_buffer_length;
+
+                if (decode_dirents(smb2, dir, &vec) < 0) {
+                        dir->status = -ENOMEM;
+                }
+        } else if (status == SMB2_STATUS_NO_MORE_FILES) {
+                dir->eof = 1;
+        } else {
+                smb2_set_nterror(smb2, status, "Query directory failed with (0x%08x) %s.",
+                               status, nterror_to_str(status));
+                dir->status = -nterror_to_errno(status);
+        }
+        dir->current_entry = dir->entries;
+
+        dir->cb(smb2, dir->status, dir, dir->cb_data);
+}
+
+/*
+ * Request the next batch of entries of a streamed directory. The batch
+ * replaces the buffered one and dir->cb is invoked once it has arrived.
+ */
 int
-smb2_opendir_async(struct smb2_context *smb2, const char *path,
-                   smb2_command_cb cb, void *cb_data)
+smb2_query_dirents_async(struct smb2_context *smb2, struct smb2dir *dir,
+                         uint8_t flags)
+{
+        struct smb2_query_directory_request req;
+        struct smb2_pdu *pdu;
+
+        if (!dir->streaming || dir->fetching) {
+                return -EINVAL;
+        }
+
+        if (flags & SMB2_RESTART_SCANS) {
+                dir->base_index = 0;
+                dir->eof = 0;
+                dir->status = 0;
+        } else {
+                dir->base_index = dir->index;
+        }
+
+        memset(&req, 0, sizeof(struct smb2_query_directory_request));
+        req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
+        req.flags = flags;
+        memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
+        req.output_buffer_length = dir_buffer_length(smb2);
+        req.name = "*";
+
+        pdu = smb2_cmd_query_directory_async(smb2, &req, query_dirents_cb, dir);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create query command.");
+                return -ENOMEM;
+        }
+        dir->fetching = 1;
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+static int
+opendir_internal(struct smb2_context *smb2, const char *path, int streaming,
+                 smb2_command_cb cb, void *cb_data)
 {
         struct smb2_create_request req;
         struct smb2dir *dir;
@@ -491,6 +756,7 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
         SMB2_LIST_ADD(&smb2->dirs, dir);
         dir->cb = cb;
         dir->cb_data = cb_data;
+        dir->streaming = streaming;
 
         memset(&req, 0, sizeof(struct smb2_create_request));
         req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
@@ -513,6 +779,20 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
         return 0;
 }
 
+int
+smb2_opendir_async(struct smb2_context *smb2, const char *path,
+                   smb2_command_cb cb, void *cb_data)
+{
+        return opendir_internal(smb2, path, 0, cb, cb_data);
+}
+
+int
+smb2_opendir_streaming_async(struct smb2_context *smb2, const char *path,
+                             smb2_command_cb cb, void *cb_data)
+{
+        return opendir_internal(smb2, path, 1, cb, cb_data);
+}
+
 extern void
 free_c_data(struct smb2_context *smb2, struct connect_data *c_data)
 {
@@ -565,26 +845,34 @@ void smb2_derive_key(
     uint32_t    label_len,
     const char  *context,
     uint32_t    context_len,
-    uint8_t     derived_key[SMB2_KEY_SIZE]
+    uint8_t     *derived_key,
+    uint32_t    derived_key_len
     )
 {
         unsigned char nul = 0;
         const uint32_t counter = htobe32(1);
-        const uint32_t keylen = htobe32(SMB2_KEY_SIZE * 8);
-        uint8_t input_key[SMB2_KEY_SIZE] = {0};
+        const uint32_t keylen = htobe32(derived_key_len * 8);
+        uint8_t input_key[SMB2_CIPHER_KEY_SIZE] = {0};
+        uint32_t input_key_len = SMB2_KEY_SIZE;
         HMACContext ctx;
         uint8_t digest[USHAMaxHashSize];
 
-        memcpy(input_key, derivation_key, MIN(sizeof(input_key),
+        /* 256 bit cipher keys are derived from the full session key,
+         * everything else from the first 16 bytes of it.
+         */
+        if (derived_key_len > SMB2_KEY_SIZE) {
+                input_key_len = MIN(sizeof(input_key), derivation_key_len);
+        }
+        memcpy(input_key, derivation_key, MIN(input_key_len,
                                               derivation_key_len));
-        hmacReset(&ctx, SHA256, input_key, sizeof(input_key));
+        hmacReset(&ctx, SHA256, input_key, input_key_len);
         hmacInput(&ctx, (unsigned char *)&counter, sizeof(counter));
         hmacInput(&ctx, (unsigned char *)label, label_len);
         hmacInput(&ctx, &nul, 1);
         hmacInput(&ctx, (unsigned char *)context, context_len);
         hmacInput(&ctx, (unsigned char *)&keylen, sizeof(keylen));
         hmacResult(&ctx, digest);
-        memcpy(derived_key, digest, SMB2_KEY_SIZE);
+        memcpy(derived_key, digest, derived_key_len);
 }
 
 /* MS-SMB2 3.2.5.2 */
@@ -612,8 +900,10 @@ smb3_update_preauth_hash(struct smb2_context *smb2, int niov,
         return 0;
 }
 
-static void smb2_create_signing_key(struct smb2_context *smb2)
+static int smb2_create_signing_key(struct smb2_context *smb2)
 {
+        uint32_t cipher_key_len = smb3_cipher_key_size(smb2->cypher);
+
         /* Derive the signing key from session key
          * This is based on negotiated protocol
          */
@@ -630,21 +920,24 @@ static void smb2_create_signing_key(struct smb2_context *smb2)
                                 sizeof(SMB2AESCMAC),
                                 SmbSign,
                                 sizeof(SmbSign),
-                                smb2->signing_key);
+                                smb2->signing_key,
+                                SMB2_KEY_SIZE);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMB2AESCCM,
                                 sizeof(SMB2AESCCM),
                                 ServerIn,
                                 sizeof(ServerIn),
-                                smb2->serverin_key);
+                                smb2->serverin_key,
+                                cipher_key_len);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMB2AESCCM,
                                 sizeof(SMB2AESCCM),
                                 ServerOut,
                                 sizeof(ServerOut),
-                                smb2->serverout_key);
+                                smb2->serverout_key,
+                                cipher_key_len);
         } else if (smb2->dialect > SMB2_VERSION_0302) {
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
@@ -652,22 +945,35 @@ static void smb2_create_signing_key(struct smb2_context *smb2)
                                 sizeof(SMBSigningKey),
                                 (char *)smb2->preauthhash,
                                 SMB2_PREAUTH_HASH_SIZE,
-                                smb2->signing_key);
+                                smb2->signing_key,
+                                SMB2_KEY_SIZE);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMBC2SCipherKey,
                                 sizeof(SMBC2SCipherKey),
                                 (char *)smb2->preauthhash,
                                 SMB2_PREAUTH_HASH_SIZE,
-                                smb2->serverin_key);
+                                smb2->serverin_key,
+                                cipher_key_len);
                 smb2_derive_key(smb2->session_key,
                                 smb2->session_key_size,
                                 SMBS2CCipherKey,
                                 sizeof(SMBS2CCipherKey),
                                 (char *)smb2->preauthhash,
                                 SMB2_PREAUTH_HASH_SIZE,
-                                smb2->serverout_key);
+                                smb2->serverout_key,
+                                cipher_key_len);
+        }
+
+        if (smb2_init_signing_ctx(smb2) < 0) {
+                return -ENOMEM;
         }
+        if (smb2->dialect > SMB2_VERSION_0210 &&
+            smb3_init_cipher_keys(smb2) < 0) {
+                return -ENOMEM;
+        }
+
+        return 0;
 }
 
 static void
@@ -757,7 +1063,12 @@ session_setup_cb(struct smb2_context *smb2, int status,
                         return;
                 }
 
-                smb2_create_signing_key(smb2);
+                if ((ret = smb2_create_signing_key(smb2)) < 0) {
+                        smb2_close_context(smb2);
+                        c_data->cb(smb2, ret, NULL, c_data->cb_data);
+                        free_c_data(smb2, c_data);
+                        return;
+                }
 
                 if (smb2->hdr.flags & SMB2_FLAGS_SIGNED) {
                         uint8_t signature[16] _U_;
@@ -888,6 +1199,12 @@ negotiate_cb(struct smb2_context *smb2, int status,
         smb2->dialect           = rep->dialect_revision;
         smb2->cypher            = rep->cypher;
 
+        if (smb2->dialect == SMB2_VERSION_0300 ||
+            smb2->dialect == SMB2_VERSION_0302) {
+                /* the cipher is only negotiated from 3.1.1 onwards */
+                smb2->cypher = SMB2_ENCRYPTION_AES_128_CCM;
+        }
+
         if (smb2->seal && (smb2->dialect == SMB2_VERSION_0300 ||
                            smb2->dialect == SMB2_VERSION_0302)) {
                 if(!(rep->capabilities & SMB2_GLOBAL_CAP_ENCRYPTION)) {
@@ -900,6 +1217,16 @@ negotiate_cb(struct smb2_context *smb2, int status,
                 }
         }
 
+        if (smb2->seal && smb2->dialect == SMB2_VERSION_0311 &&
+            smb3_cipher_key_size(smb2->cypher) == 0) {
+                smb2_set_error(smb2, "Encryption requested but server "
+                               "selected no supported cipher.");
+                smb2_close_context(smb2);
+                c_data->cb(smb2, -ENOMEM, NULL, c_data->cb_data);
+                free_c_data(smb2, c_data);
+                return;
+        }
+
         if (smb2->sign &&
             !(rep->security_mode & SMB2_NEGOTIATE_SIGNING_ENABLED)) {
                 smb2_set_error(smb2, "Signing requested but server "
@@ -1143,7 +1470,13 @@ smb2_connect_share_async(struct smb2_context *smb2,
 static void
 free_smb2fh(struct smb2_context *smb2, struct smb2fh *fh)
 {
+        int i;
+
         SMB2_LIST_REMOVE(&smb2->fhs, fh);
+        for (i = 0; i < fh->ra.num_chunks; i++) {
+                free(fh->ra.chunks[i].buf);
+        }
+        free(fh->ra.chunks);
         free(fh);
 }
 
@@ -1293,6 +1626,52 @@ smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *path
         return 0;
 }
 
+int
+smb2_open_dir_handle_async(struct smb2_context *smb2, const char *path,
+                           smb2_command_cb cb, void *cb_data)
+{
+        struct smb2fh *fh;
+        struct smb2_create_request req;
+        struct smb2_pdu *pdu;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+
+        fh = calloc(1, sizeof(struct smb2fh));
+        if (fh == NULL) {
+                smb2_set_error(smb2, "Failed to allocate smbfh");
+                return -ENOMEM;
+        }
+        SMB2_LIST_ADD(&smb2->fhs, fh);
+
+        fh->cb = cb;
+        fh->cb_data = cb_data;
+
+        memset(&req, 0, sizeof(struct smb2_create_request));
+        req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+        req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+        req.desired_access = SMB2_FILE_LIST_DIRECTORY |
+                SMB2_FILE_READ_ATTRIBUTES | SMB2_SYNCHRONIZE;
+        req.file_attributes = 0;
+        /* Don't get in the way of anyone renaming or deleting it */
+        req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE |
+                SMB2_FILE_SHARE_DELETE;
+        req.create_disposition = SMB2_FILE_OPEN;
+        req.create_options = SMB2_FILE_DIRECTORY_FILE;
+        req.name = path;
+
+        pdu = smb2_cmd_create_async(smb2, &req, open_cb, fh);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create create command");
+                free_smb2fh(smb2, fh);
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
 int
 smb2_open_async(struct smb2_context *smb2, const char *path, int flags,
                 smb2_command_cb cb, void *cb_data)
@@ -1617,6 +1996,71 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+/* Takes the place of the callback of a request whose reply no longer
+ * has anyone to go to */
+static void
+orphan_cb(struct smb2_context *smb2, int status,
+          void *command_data, void *private_data)
+{
+}
+
+/* The filehandle a read or write request is for, NULL for other pdus */
+static struct smb2fh *
+smb2_pdu_fh(struct smb2_pdu *pdu)
+{
+        if (pdu->cb == read_cb) {
+                return ((struct read_data *)pdu->cb_data)->read_cb_data.fh;
+        }
+        if (pdu->cb == write_cb) {
+                return ((struct write_data *)pdu->cb_data)->write_cb_data.fh;
+        }
+        return NULL;
+}
+
+/* Fails a request for fh now, leaving a pdu that is safe to complete
+ * after fh and the caller's buffers are gone */
+static void
+smb2_orphan_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        pdu->cb(smb2, SMB2_STATUS_CANCELLED, NULL, pdu->cb_data);
+        pdu->cb = orphan_cb;
+        pdu->cb_data = NULL;
+        /* the reply data is read into padding instead */
+        smb2_free_iovector(smb2, &pdu->in);
+}
+
+void
+smb2_abandon_fh(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_pdu *pdu, *next;
+        int i;
+
+        /* not sent yet, like smb2_timeout_pdus() these are just dropped */
+        for (pdu = smb2->outqueue; pdu; pdu = next) {
+                next = pdu->next;
+                if (smb2_pdu_fh(pdu) == fh) {
+                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
+                        pdu->cb(smb2, SMB2_STATUS_CANCELLED, NULL,
+                                pdu->cb_data);
+                        smb2_free_pdu(smb2, pdu);
+                }
+        }
+
+        /* the server will still reply to these */
+        for (i = 0; i < SMB2_WAITQUEUE_HASH_SIZE; i++) {
+                for (pdu = smb2->waitqueue[i]; pdu; pdu = pdu->next) {
+                        if (smb2_pdu_fh(pdu) == fh) {
+                                smb2_orphan_pdu(smb2, pdu);
+                        }
+                }
+        }
+        if (smb2->pdu && smb2_pdu_fh(smb2->pdu) == fh) {
+                smb2_orphan_pdu(smb2, smb2->pdu);
+        }
+
+        free_smb2fh(smb2, fh);
+}
+
 int
 smb2_write_async(struct smb2_context *smb2, struct smb2fh *fh,
                  const uint8_t *buf, uint32_t count,
@@ -1717,60 +2161,128 @@ create_cb_1(struct smb2_context *smb2, int status,
         }
 }
 
+struct unlink_cb_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        uint32_t status;
+};
+
+static void
+unlink_cb_3(struct smb2_context *smb2, int status,
+            void *command_data _U_, void *private_data)
+{
+        struct unlink_cb_data *unlink_data = private_data;
+
+        if (unlink_data->status == SMB2_STATUS_SUCCESS) {
+                unlink_data->status = status;
+        }
+
+        unlink_data->cb(smb2, -nterror_to_errno(unlink_data->status),
+                        NULL, unlink_data->cb_data);
+        free(unlink_data);
+}
+
+static void
+unlink_cb_1(struct smb2_context *smb2, int status,
+            void *command_data _U_, void *private_data)
+{
+        struct unlink_cb_data *unlink_data = private_data;
+
+        if (unlink_data->status == SMB2_STATUS_SUCCESS) {
+                unlink_data->status = status;
+        }
+}
+
+/*
+ * Files are opened with DELETE_ON_CLOSE and closed again.
+ * Directories set the delete disposition explicitly between the two,
+ * so that a directory that is not empty fails right there with
+ * STATUS_DIRECTORY_NOT_EMPTY instead of being silently kept on close.
+ * Either way the whole delete is a single compound request.
+ */
 static int
 smb2_unlink_internal(struct smb2_context *smb2, const char *path,
                      int is_dir,
                      smb2_command_cb cb, void *cb_data)
 {
-        struct create_cb_data *create_data;
+        struct unlink_cb_data *unlink_data;
         struct smb2_create_request cr_req;
+        struct smb2_set_info_request si_req;
         struct smb2_close_request cl_req;
         struct smb2_pdu *pdu, *next_pdu;
+        struct smb2_file_disposition_info fdi _U_;
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
-        create_data = calloc(1, sizeof(struct create_cb_data));
-        if (create_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate create_data");
+        unlink_data = calloc(1, sizeof(struct unlink_cb_data));
+        if (unlink_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate unlink_data");
                 return -ENOMEM;
         }
 
-        create_data->cb = cb;
-        create_data->cb_data = cb_data;
-
+        unlink_data->cb = cb;
+        unlink_data->cb_data = cb_data;
 
+        /* CREATE command */
         memset(&cr_req, 0, sizeof(struct smb2_create_request));
         cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
         cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
         cr_req.desired_access = SMB2_DELETE;
         if (is_dir) {
                 cr_req.file_attributes = SMB2_FILE_ATTRIBUTE_DIRECTORY;
+                cr_req.create_options = SMB2_FILE_DIRECTORY_FILE;
         } else {
                 cr_req.file_attributes = SMB2_FILE_ATTRIBUTE_NORMAL;
+                cr_req.create_options = SMB2_FILE_DELETE_ON_CLOSE;
         }
         cr_req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE |
                 SMB2_FILE_SHARE_DELETE;
         cr_req.create_disposition = SMB2_FILE_OPEN;
-        cr_req.create_options = SMB2_FILE_DELETE_ON_CLOSE;
         cr_req.name = path;
 
-        pdu = smb2_cmd_create_async(smb2, &cr_req, create_cb_1, create_data);
+        pdu = smb2_cmd_create_async(smb2, &cr_req, unlink_cb_1, unlink_data);
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create create command");
+                free(unlink_data);
                 return -ENOMEM;
         }
 
+        /* SET INFO command */
+        if (is_dir) {
+                fdi.delete_pending = 1;
+
+                memset(&si_req, 0, sizeof(struct smb2_set_info_request));
+                si_req.info_type = SMB2_0_INFO_FILE;
+                si_req.file_info_class = SMB2_FILE_DISPOSITION_INFORMATION;
+                si_req.additional_information = 0;
+                memcpy(si_req.file_id, compound_file_id, SMB2_FD_SIZE);
+                si_req.input_data = &fdi;
+
+                next_pdu = smb2_cmd_set_info_async(smb2, &si_req,
+                                                   unlink_cb_1, unlink_data);
+                if (next_pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to create set command. %s",
+                                       smb2_get_error(smb2));
+                        free(unlink_data);
+                        smb2_free_pdu(smb2, pdu);
+                        return -ENOMEM;
+                }
+                smb2_add_compound_pdu(smb2, pdu, next_pdu);
+        }
+
+        /* CLOSE command */
         memset(&cl_req, 0, sizeof(struct smb2_close_request));
         cl_req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
         memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
 
-        next_pdu = smb2_cmd_close_async(smb2, &cl_req, create_cb_2, create_data);
+        next_pdu = smb2_cmd_close_async(smb2, &cl_req, unlink_cb_3, unlink_data);
         if (next_pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create close command");
+                free(unlink_data);
                 smb2_free_pdu(smb2, pdu);
-                free(create_data);
                 return -ENOMEM;
         }
         smb2_add_compound_pdu(smb2, pdu, next_pdu);
@@ -2746,6 +3258,24 @@ smb2_get_file_id(struct smb2fh *fh)
         return &fh->file_id;
 }
 
+struct smb2_write_behind *
+smb2_fh_write_behind(struct smb2fh *fh)
+{
+        return &fh->wb;
+}
+
+struct smb2_read_ahead *
+smb2_fh_read_ahead(struct smb2fh *fh)
+{
+        return &fh->ra;
+}
+
+struct smb2_pread_pipeline *
+smb2_fh_pread_pipeline(struct smb2fh *fh)
+{
+        return &fh->pp;
+}
+
 struct smb2fh *
 smb2_fh_from_file_id(struct smb2_context *smb2, smb2_file_id *fileid)
 {
@@ -2875,31 +3405,55 @@ notify_change_cb(struct smb2_context *smb2, int status,
 
         struct smb2_change_notify_reply *rep = command_data;
         struct smb2_iovec vec;
-        struct smb2_file_notify_change_information *fnc = calloc(1, sizeof(struct smb2_file_notify_change_information));
+        struct smb2_file_notify_change_information *fnc;
 
-        if (status) {
-                smb2_set_error(smb2, "notify_change_cb failed (%s) %s\n",
-                               strerror(-status), smb2_get_error(smb2));
+        /* NOTIFY_ENUM_DIR means too much changed to list it, the
+         * reply is then empty. Any other status ends the watch,
+         * e.g. NOTIFY_CLEANUP when the handle is closed or SHUTDOWN
+         * when the context is destroyed, so there is no rearming.
+         */
+        if (status != SMB2_STATUS_SUCCESS &&
+            status != SMB2_STATUS_NOTIFY_ENUM_DIR) {
+                smb2_set_nterror(smb2, status, "Notify change failed with (0x%08x) %s",
+                                 status, nterror_to_str(status));
+                if (notify_change_data->cb) {
+                        notify_change_data->cb(smb2, -nterror_to_errno(status),
+                                               NULL, notify_change_data->cb_data);
+                }
+                free(notify_change_data);
+                return;
         }
 
-        vec.buf = rep->output;
-        vec.len = rep->output_buffer_length;
+        fnc = calloc(1, sizeof(struct smb2_file_notify_change_information));
+        if (fnc == NULL) {
+                smb2_set_error(smb2, "Failed to allocate notify change information");
+        } else if (rep->output_buffer_length >= 12) {
+                vec.buf = rep->output;
+                vec.len = rep->output_buffer_length;
 
-        if (smb2_decode_filenotifychangeinformation(smb2, fnc, &vec, 0)) {
-                smb2_set_error(smb2, "Failed to decode file notify change information\n");
+                if (smb2_decode_filenotifychangeinformation(smb2, fnc, &vec, 0)) {
+                        smb2_set_error(smb2, "Failed to decode file notify change information\n");
+                }
         }
 
         if (notify_change_data->cb) {
                 notify_change_data->cb(
                         smb2,
-                        -nterror_to_errno(notify_change_data->status),
+                        0,
                         fnc,
                         notify_change_data->cb_data
                 );
         }
         if (notify_change_data->loop) {
-                smb2_notify_change_filehandle_async(smb2, notify_change_data->fh, notify_change_data->flags, notify_change_data->filter,
-                        notify_change_data->loop, notify_change_data->cb, notify_change_data->cb_data);
+                if (smb2_notify_change_filehandle_async(smb2, notify_change_data->fh, notify_change_data->flags, notify_change_data->filter,
+                        notify_change_data->loop, notify_change_data->cb, notify_change_data->cb_data) < 0) {
+                        /* end the watch the same way as a failed notify,
+                         * so the caller does not rely on it any more */
+                        if (notify_change_data->cb) {
+                                notify_change_data->cb(smb2, -ENOMEM, NULL,
+                                                       notify_change_data->cb_data);
+                        }
+                }
         } else {
                 smb2_close(smb2, notify_change_data->fh);
         }
@@ -3751,7 +4305,10 @@ smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *comma
                 /* Derive the signing key from session key
                 * This is based on negotiated protocol
                 */
-                smb2_create_signing_key(smb2);
+                if (smb2_create_signing_key(smb2) < 0) {
+                        smb2_close_context(smb2);
+                        return;
+                }
         }
 
         if (server->allow_anonymous &&
@@ -3922,6 +4479,11 @@ smb2_negotiate_request_cb(struct smb2_context *smb2, int status, void *command_d
                         }
                 }
 
+                if (smb2->dialect == SMB2_VERSION_0300 ||
+                    smb2->dialect == SMB2_VERSION_0302) {
+                        smb2->cypher = SMB2_ENCRYPTION_AES_128_CCM;
+                }
+
                 if (smb2->seal && (smb2->dialect == SMB2_VERSION_0300 ||
                                    smb2->dialect == SMB2_VERSION_0302)) {
                         if(!(req->capabilities & SMB2_GLOBAL_CAP_ENCRYPTION)) {
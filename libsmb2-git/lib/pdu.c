@@ -27,6 +27,8 @@
 #include <stdint.h>
 #endif
 
+#include <stddef.h>
+
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
@@ -47,6 +49,14 @@
 #include <sys/time.h>
 #endif
 
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_SYS_ERRNO_H
+#include <sys/errno.h>
+#endif
+
 #include "compat.h"
 
 #include "portable-endian.h"
@@ -88,10 +98,24 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
         struct smb2_header *hdr;
         char magic[4] = {0xFE, 'S', 'M', 'B'};
 
-        pdu = calloc(1, sizeof(struct smb2_pdu));
-        if (pdu == NULL) {
-                smb2_set_error(smb2, "Failed to allocate pdu");
-                return NULL;
+        if (smb2->pdu_pool) {
+                pdu = smb2->pdu_pool;
+                smb2->pdu_pool = pdu->next;
+                smb2->pdu_pool_count--;
+                /* the io vectors and the arena are large and only
+                 * valid up to their counters, so only clear the rest
+                 */
+                memset(pdu, 0, offsetof(struct smb2_pdu, out));
+                pdu->out.num_done = pdu->out.total_size = 0;
+                pdu->in.num_done = pdu->in.total_size = 0;
+                pdu->in.niov = 0;
+                pdu->arena_used = 0;
+        } else {
+                pdu = calloc(1, sizeof(struct smb2_pdu));
+                if (pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate pdu");
+                        return NULL;
+                }
         }
 
         hdr = &pdu->header;
@@ -350,10 +374,54 @@ smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
         }
 
         free(pdu->payload);
-        free(pdu->crypt);
+
+        if (smb2->pdu_pool_count < SMB2_PDU_POOL_SIZE) {
+                pdu->next = smb2->pdu_pool;
+                smb2->pdu_pool = pdu;
+                smb2->pdu_pool_count++;
+                return;
+        }
         free(pdu);
 }
 
+void
+smb2_free_pdu_pool(struct smb2_context *smb2)
+{
+        while (smb2->pdu_pool) {
+                struct smb2_pdu *pdu = smb2->pdu_pool;
+
+                smb2->pdu_pool = pdu->next;
+                free(pdu);
+        }
+        smb2->pdu_pool_count = 0;
+}
+
+/*
+ * Add a zeroed buffer of len bytes to the out vectors of a PDU.
+ * Small buffers are carved from the arena embedded in the PDU and go
+ * away with it, larger ones fall back to calloc.
+ */
+struct smb2_iovec *
+smb2_add_iovector_alloc(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                        size_t len)
+{
+        size_t aligned = (len + 7) & ~(size_t)7;
+        uint8_t *buf;
+
+        if (pdu->arena_used + aligned <= SMB2_PDU_ARENA_SIZE) {
+                buf = (uint8_t *)pdu->arena + pdu->arena_used;
+                pdu->arena_used += aligned;
+                memset(buf, 0, len);
+                return smb2_add_iovector(smb2, &pdu->out, buf, len, NULL);
+        }
+
+        buf = calloc(len, sizeof(uint8_t));
+        if (buf == NULL) {
+                return NULL;
+        }
+        return smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+}
+
 int
 smb2_set_uint8(struct smb2_iovec *iov, int offset, uint8_t value)
 {
@@ -634,13 +702,127 @@ smb2_correlate_reply(struct smb2_context *smb2, struct smb2_pdu *pdu)
                                pdu->header.flags |= SMB2_FLAGS_ASYNC_COMMAND;
                                pdu->header.async.async_id = req_pdu->header.async.async_id;
                        }
-                       SMB2_LIST_REMOVE(&smb2->waitqueue, req_pdu);
+                       smb2_waitqueue_remove(smb2, req_pdu);
                        smb2_free_pdu(smb2, req_pdu);
                 }
         }
         return ret;
 }
 
+static uint64_t
+smb2_trace_now(void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Microseconds since the record was queued, saturating */
+static uint32_t
+smb2_trace_delta(const struct smb2_trace_rec *rec)
+{
+        uint64_t now = smb2_trace_now();
+
+        if (now < rec->queue_us) {
+                return 0;
+        }
+        if (now - rec->queue_us > 0xffffffffU) {
+                return 0xffffffffU;
+        }
+        return (uint32_t)(now - rec->queue_us);
+}
+
+static void
+smb2_trace_queued(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                  int compound)
+{
+        struct smb2_trace *trace = smb2->trace;
+        struct smb2_trace_rec *rec;
+
+        if (++trace->seq == 0) {
+                /* 0 marks an untraced pdu */
+                trace->seq = 1;
+        }
+        rec = &trace->recs[trace->seq & trace->mask];
+        memset(rec, 0, sizeof(*rec));
+        rec->seq = trace->seq;
+        rec->message_id = pdu->header.message_id;
+        rec->queue_us = smb2_trace_now();
+        rec->command = pdu->header.command;
+        rec->credit_charge = pdu->header.credit_charge;
+        rec->credit_request = pdu->header.credit_request_response;
+        rec->credits = smb2->credits < 0 ? 0 :
+                (smb2->credits > 0xffff ? 0xffff : smb2->credits);
+        if (compound) {
+                rec->flags |= SMB2_TRACE_COMPOUND;
+        }
+        if (pdu->seal) {
+                rec->flags |= SMB2_TRACE_SEALED;
+        }
+        pdu->trace_seq = trace->seq;
+}
+
+/* The record of pdu, or NULL if it has been overwritten since */
+static struct smb2_trace_rec *
+smb2_trace_find(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_trace_rec *rec;
+
+        if (smb2->trace == NULL || pdu->trace_seq == 0) {
+                return NULL;
+        }
+        rec = &smb2->trace->recs[pdu->trace_seq & smb2->trace->mask];
+        return rec->seq == pdu->trace_seq ? rec : NULL;
+}
+
+void
+smb2_trace_sent(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                uint32_t bytes)
+{
+        struct smb2_trace_rec *rec = smb2_trace_find(smb2, pdu);
+
+        if (rec == NULL) {
+                return;
+        }
+        rec->send_us = smb2_trace_delta(rec);
+        rec->out_bytes = bytes;
+        rec->flags |= SMB2_TRACE_SENT;
+}
+
+void
+smb2_trace_reply(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                 uint32_t status, uint16_t credit_grant, uint32_t bytes)
+{
+        struct smb2_trace_rec *rec = smb2_trace_find(smb2, pdu);
+
+        if (rec == NULL) {
+                return;
+        }
+        rec->credit_grant += credit_grant;
+        if (status == SMB2_STATUS_PENDING) {
+                rec->flags |= SMB2_TRACE_PENDING;
+                return;
+        }
+        rec->reply_us = smb2_trace_delta(rec);
+        rec->status = status;
+        rec->in_bytes = bytes;
+        rec->flags |= SMB2_TRACE_REPLIED;
+}
+
+static void
+smb2_trace_timeout(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_trace_rec *rec = smb2_trace_find(smb2, pdu);
+
+        if (rec == NULL) {
+                return;
+        }
+        rec->reply_us = smb2_trace_delta(rec);
+        rec->status = SMB2_STATUS_IO_TIMEOUT;
+        rec->flags |= SMB2_TRACE_TIMEOUT;
+}
+
 void
 smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
@@ -670,6 +852,10 @@ smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
                         /* TODO - care about check reply failures? */
                 }
                 smb2_encode_header(smb2, &p->out.iov[0], &p->header);
+                if (smb2->trace && !smb2_is_server(smb2)) {
+                        smb2_trace_queued(smb2, p, p != pdu ||
+                                          p->next_compound != NULL);
+                }
                 if (smb2->sign ||
                     (p->header.command == SMB2_TREE_CONNECT && smb2->dialect == SMB2_VERSION_0311 && !smb2->seal)) {
                         if (smb2_pdu_add_signature(smb2, p) < 0) {
@@ -680,8 +866,8 @@ smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
                 }
         }
 
-        smb3_encrypt_pdu(smb2, pdu);
-
+        /* sealing is done by smb2_write_to_socket() when the chain
+         * reaches the head of the outqueue */
         smb2_add_to_outqueue(smb2, pdu);
 }
 
@@ -736,12 +922,52 @@ smb2_get_last_reply_message_id(struct smb2_context *smb2)
         return 0;
 }
 
+#define WAITQUEUE_BUCKET(id) ((id) & (SMB2_WAITQUEUE_HASH_SIZE - 1))
+
+void
+smb2_waitqueue_add(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        SMB2_LIST_ADD(&smb2->waitqueue[WAITQUEUE_BUCKET(pdu->header.message_id)], pdu);
+        smb2->waitqueue_count++;
+}
+
+void
+smb2_waitqueue_remove(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        SMB2_LIST_REMOVE(&smb2->waitqueue[WAITQUEUE_BUCKET(pdu->header.message_id)], pdu);
+        smb2->waitqueue_count--;
+}
+
+/*
+ * Remove and return any PDU from the waitqueue, NULL if it is empty.
+ */
+struct smb2_pdu *
+smb2_waitqueue_pop(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+        int i;
+
+        if (smb2->waitqueue_count == 0) {
+                return NULL;
+        }
+        for (i = 0; i < SMB2_WAITQUEUE_HASH_SIZE; i++) {
+                pdu = smb2->waitqueue[i];
+                if (pdu) {
+                        smb2->waitqueue[i] = pdu->next;
+                        pdu->next = NULL;
+                        smb2->waitqueue_count--;
+                        return pdu;
+                }
+        }
+        return NULL;
+}
+
 struct smb2_pdu *
 smb2_find_pdu(struct smb2_context *smb2,
               uint64_t message_id) {
         struct smb2_pdu *pdu;
 
-        for (pdu = smb2->waitqueue; pdu; pdu = pdu->next) {
+        for (pdu = smb2->waitqueue[WAITQUEUE_BUCKET(message_id)]; pdu; pdu = pdu->next) {
                 if (pdu->header.message_id == message_id) {
                         break;
                 }
@@ -1104,12 +1330,14 @@ void smb2_timeout_pdus(struct smb2_context *smb2)
 {
         struct smb2_pdu *pdu, *next;
         time_t t = time(NULL);
+        int i;
 
         pdu = smb2->outqueue;
         while (pdu) {
                 next = pdu->next;
                 if (pdu->timeout && pdu->timeout < t) {
                         SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
+                        smb2_trace_timeout(smb2, pdu);
                         pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
                                 pdu->cb_data);
                         smb2_free_pdu(smb2, pdu);
@@ -1117,16 +1345,124 @@ void smb2_timeout_pdus(struct smb2_context *smb2)
                 pdu = next;
         }
 
-        pdu = smb2->waitqueue;
-        while (pdu) {
-                next = pdu->next;
-                if (pdu->timeout && pdu->timeout < t) {
-                        SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
-                        smb2_free_pdu(smb2, pdu);
+        for (i = 0; i < SMB2_WAITQUEUE_HASH_SIZE && smb2->waitqueue_count; i++) {
+                pdu = smb2->waitqueue[i];
+                while (pdu) {
+                        next = pdu->next;
+                        if (pdu->timeout && pdu->timeout < t) {
+                                smb2_waitqueue_remove(smb2, pdu);
+                                smb2_trace_timeout(smb2, pdu);
+                                pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
+                                        pdu->cb_data);
+                                smb2_free_pdu(smb2, pdu);
+                        }
+                        pdu = next;
                 }
-                pdu = next;
         }
 }
 
+
+static void
+smb2_trace_put16(uint8_t **p, uint16_t v)
+{
+        (*p)[0] = v & 0xff;
+        (*p)[1] = (v >> 8) & 0xff;
+        *p += 2;
+}
+
+static void
+smb2_trace_put32(uint8_t **p, uint32_t v)
+{
+        smb2_trace_put16(p, v & 0xffff);
+        smb2_trace_put16(p, v >> 16);
+}
+
+static void
+smb2_trace_put64(uint8_t **p, uint64_t v)
+{
+        smb2_trace_put32(p, (uint32_t)v);
+        smb2_trace_put32(p, (uint32_t)(v >> 32));
+}
+
+int
+smb2_dump_trace(struct smb2_context *smb2, const char *path)
+{
+        struct smb2_trace *trace = smb2->trace;
+        const struct smb2_trace_rec *rec;
+        uint8_t buf[SMB2_TRACE_RECORD_SIZE];
+        uint8_t *p;
+        uint32_t first, seq, count = 0;
+        FILE *fh;
+        int err;
+
+        if (trace == NULL) {
+                smb2_set_error(smb2, "tracing is not enabled");
+                return -EINVAL;
+        }
+
+        /* records are written oldest first, skipping unused slots */
+        first = trace->seq > trace->mask ? trace->seq - trace->mask : 1;
+        for (seq = first; seq != trace->seq + 1; seq++) {
+                if (trace->recs[seq & trace->mask].seq == seq) {
+                        count++;
+                }
+        }
+
+        fh = fopen(path, "wb");
+        if (fh == NULL) {
+                err = errno;
+                smb2_set_error(smb2, "Failed to create %s: %s", path,
+                               strerror(err));
+                return -err;
+        }
+
+        p = buf;
+        memcpy(p, SMB2_TRACE_MAGIC, 8);
+        p += 8;
+        smb2_trace_put32(&p, SMB2_TRACE_VERSION);
+        smb2_trace_put32(&p, SMB2_TRACE_RECORD_SIZE);
+        smb2_trace_put32(&p, count);
+        smb2_trace_put32(&p, trace->seq);
+        if (fwrite(buf, p - buf, 1, fh) != 1) {
+                goto write_failed;
+        }
+
+        for (seq = first; seq != trace->seq + 1; seq++) {
+                rec = &trace->recs[seq & trace->mask];
+                if (rec->seq != seq) {
+                        continue;
+                }
+                p = buf;
+                smb2_trace_put64(&p, rec->message_id);
+                smb2_trace_put64(&p, rec->queue_us);
+                smb2_trace_put32(&p, rec->seq);
+                smb2_trace_put32(&p, rec->send_us);
+                smb2_trace_put32(&p, rec->reply_us);
+                smb2_trace_put32(&p, rec->status);
+                smb2_trace_put32(&p, rec->out_bytes);
+                smb2_trace_put32(&p, rec->in_bytes);
+                smb2_trace_put16(&p, rec->command);
+                smb2_trace_put16(&p, rec->credit_charge);
+                smb2_trace_put16(&p, rec->credit_request);
+                smb2_trace_put16(&p, rec->credit_grant);
+                smb2_trace_put16(&p, rec->credits);
+                smb2_trace_put16(&p, rec->flags);
+                if (fwrite(buf, sizeof(buf), 1, fh) != 1) {
+                        goto write_failed;
+                }
+        }
+
+        if (fclose(fh) != 0) {
+                err = errno;
+                smb2_set_error(smb2, "Failed to write %s: %s", path,
+                               strerror(err));
+                return err ? -err : -EIO;
+        }
+        return 0;
+
+ write_failed:
+        err = errno;
+        fclose(fh);
+        smb2_set_error(smb2, "Failed to write %s: %s", path, strerror(err));
+        return err ? -err : -EIO;
+}
@@ -61,18 +61,15 @@ smb2_encode_close_request(struct smb2_context *smb2,
                           struct smb2_close_request *req)
 {
         int len;
-        uint8_t *buf;
         struct smb2_iovec *iov;
 
         len = SMB2_CLOSE_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate close buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_CLOSE_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->flags);
         memcpy(iov->buf + 8, req->file_id, SMB2_FD_SIZE);
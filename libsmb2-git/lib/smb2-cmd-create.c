@@ -70,14 +70,12 @@ smb2_encode_create_request(struct smb2_context *smb2,
         struct smb2_iovec *iov;
 
         len = SMB2_CREATE_REQUEST_SIZE & 0xfffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate create buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         /* Name */
         if (req->name && req->name[0]) {
                 name = smb2_utf8_to_utf16(req->name);
@@ -122,18 +120,13 @@ smb2_encode_create_request(struct smb2_context *smb2,
         /* Name */
         if (name) {
                 len = PAD_TO_64BIT(name_byte_len);
-                buf = malloc(len);
-                if (buf == NULL) {
+                iov = smb2_add_iovector_alloc(smb2, pdu, len);
+                if (iov == NULL) {
                         smb2_set_error(smb2, "Failed to allocate create name");
                         free(name);
                         return -1;
                 }
-                memcpy(buf, &name->val[0], name_byte_len);
-                memset(buf + name_byte_len, 0, len - name_byte_len);
-                iov = smb2_add_iovector(smb2, &pdu->out,
-                                        buf,
-                                        len,
-                                        free);
+                memcpy(iov->buf, &name->val[0], name_byte_len);
                 /* Convert '/' to '\' */
                 for (i = 0; i < name->len; i++) {
                         smb2_get_uint16(iov, i * 2, &ch);
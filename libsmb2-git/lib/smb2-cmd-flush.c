@@ -61,18 +61,15 @@ smb2_encode_flush_request(struct smb2_context *smb2,
                           struct smb2_flush_request *req)
 {
         int len;
-        uint8_t *buf;
         struct smb2_iovec *iov;
 
         len = SMB2_FLUSH_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate flush buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_FLUSH_REQUEST_SIZE);
         memcpy(iov->buf + 8, req->file_id, SMB2_FD_SIZE);
 
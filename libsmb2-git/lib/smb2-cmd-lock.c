@@ -61,7 +61,6 @@ smb2_encode_lock_request(struct smb2_context *smb2,
                           struct smb2_lock_request *req)
 {
         int len;
-        uint8_t *buf;
         struct smb2_iovec *iov;
         struct smb2_lock_element *elements;
         uint32_t u32;
@@ -69,14 +68,12 @@ smb2_encode_lock_request(struct smb2_context *smb2,
         uint32_t offset;
 
         len = SMB2_LOCK_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate lock buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_LOCK_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->lock_count);
         u32 = (req->lock_sequence_number << 28) | req->lock_sequence_index;
@@ -94,12 +91,11 @@ smb2_encode_lock_request(struct smb2_context *smb2,
 
         if ((req->lock_count > 1) && req->locks) {
                 len = PAD_TO_64BIT(SMB2_LOCK_ELEMENT_SIZE * req->lock_count);
-                buf = calloc(len, sizeof(uint8_t));
-                if (buf == NULL) {
+                iov = smb2_add_iovector_alloc(smb2, pdu, len);
+                if (iov == NULL) {
                         smb2_set_error(smb2, "Failed to allocate locks buffer");
                         return -1;
                 }
-                iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
 
                 for (i = 0, offset = 0; i < req->lock_count - 1; i++) {
                         smb2_set_uint64(iov, offset, elements->offset);
@@ -57,20 +57,17 @@ static int
 smb2_encode_logoff_request(struct smb2_context *smb2,
                            struct smb2_pdu *pdu)
 {
-        uint8_t *buf;
         int len;
         struct smb2_iovec *iov;
 
         len = SMB2_LOGOFF_REQUEST_SIZE;
 
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate logoff buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_LOGOFF_REQUEST_SIZE);
 
         return 0;
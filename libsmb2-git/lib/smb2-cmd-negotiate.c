@@ -90,11 +90,20 @@ smb2_encode_preauth_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
 static int
 smb2_encode_encryption_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
+        static const uint16_t ciphers[] = {
+                SMB2_ENCRYPTION_AES_128_GCM,
+                SMB2_ENCRYPTION_AES_256_GCM,
+                SMB2_ENCRYPTION_AES_128_CCM,
+        };
         uint8_t *buf;
-        int len, data_len;
+        int i, count, len, data_len;
         struct smb2_iovec *iov;
 
-        data_len = PAD_TO_64BIT(4);
+        /* A server answers with the single cipher it selected, a client
+         * offers everything it supports in order of preference. */
+        count = smb2_is_server(smb2) ? 1 : sizeof(ciphers) / sizeof(ciphers[0]);
+
+        data_len = 2 + count * 2;
         len = 8 + data_len;
         len = PAD_TO_64BIT(len);
         buf = malloc(len);
@@ -107,8 +116,15 @@ smb2_encode_encryption_context(struct smb2_context *smb2, struct smb2_pdu *pdu)
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
         smb2_set_uint16(iov, 0, SMB2_ENCRYPTION_CAP);
         smb2_set_uint16(iov, 2, data_len);
-        smb2_set_uint16(iov, 8, 1);
-        smb2_set_uint16(iov, 10, SMB2_ENCRYPTION_AES_128_CCM);
+        smb2_set_uint16(iov, 8, count);
+        if (smb2_is_server(smb2)) {
+                smb2_set_uint16(iov, 10, smb2->cypher ? smb2->cypher :
+                                SMB2_ENCRYPTION_AES_128_CCM);
+        } else {
+                for (i = 0; i < count; i++) {
+                        smb2_set_uint16(iov, 10 + i * 2, ciphers[i]);
+                }
+        }
 
         return 0;
 }
@@ -118,7 +134,6 @@ smb2_encode_negotiate_request(struct smb2_context *smb2,
                               struct smb2_pdu *pdu,
                               struct smb2_negotiate_request *req)
 {
-        uint8_t *buf;
         int i, len;
         struct smb2_iovec *iov;
 
@@ -133,14 +148,12 @@ smb2_encode_negotiate_request(struct smb2_context *smb2,
                         len += 4;
                 }
         }
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate negotiate buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         if (smb2->version == SMB2_VERSION_ANY ||
             smb2->version == SMB2_VERSION_ANY3 ||
             smb2->version == SMB2_VERSION_0311) {
@@ -310,7 +323,16 @@ smb2_parse_encryption_context(struct smb2_context *smb2,
                               struct smb2_iovec *iov,
                               int offset)
 {
-        smb2_get_uint16(iov, offset, &rep->cypher);
+        uint16_t count;
+
+        /* the server returns exactly one cipher, 0 if there was no match */
+        smb2_get_uint16(iov, offset, &count);
+        if (count != 1) {
+                smb2_set_error(smb2, "Bad cipher count %d in negotiate "
+                               "reply", count);
+                return -1;
+        }
+        smb2_get_uint16(iov, offset + 2, &rep->cypher);
         return 0;
 }
 
@@ -520,6 +542,25 @@ smb2_parse_encryption_request_context(struct smb2_context *smb2,
                               struct smb2_iovec *iov,
                               int offset, int len)
 {
+        uint16_t count, cipher;
+        int i;
+
+        /* pick the first cipher in the client's list that we support */
+        smb2_get_uint16(iov, offset, &count);
+        if (len < 2 + count * 2) {
+                smb2_set_error(smb2, "Bad cipher count in negotiate request");
+                return -1;
+        }
+        for (i = 0; i < count; i++) {
+                smb2_get_uint16(iov, offset + 2 + i * 2, &cipher);
+                switch (cipher) {
+                case SMB2_ENCRYPTION_AES_128_CCM:
+                case SMB2_ENCRYPTION_AES_128_GCM:
+                case SMB2_ENCRYPTION_AES_256_GCM:
+                        smb2->cypher = cipher;
+                        return 0;
+                }
+        }
         return 0;
 }
 
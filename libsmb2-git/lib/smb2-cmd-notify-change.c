@@ -61,19 +61,16 @@ smb2_encode_change_notify_request(struct smb2_context *smb2,
                           struct smb2_change_notify_request *req)
 {
         int len;
-        uint8_t *buf;
         struct smb2_iovec *iov;
 
         len = SMB2_CHANGE_NOTIFY_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate "
                                 "change-notify buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_CHANGE_NOTIFY_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->flags);
         smb2_set_uint32(iov, 4, req->output_buffer_length);
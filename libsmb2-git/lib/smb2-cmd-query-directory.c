@@ -53,13 +53,17 @@
 #include "libsmb2.h"
 #include "libsmb2-private.h"
 
+/*
+ * Decode everything but the name. *name_len is set to the length of
+ * the UTF-16 name, in bytes, which starts at offset 80 of vec.
+ */
 int
-smb2_decode_fileidfulldirectoryinformation(
+smb2_decode_fileidfulldirectoryinformation_fields(
     struct smb2_context *smb2,
     struct smb2_fileidfulldirectoryinformation *fs,
-    struct smb2_iovec *vec)
+    struct smb2_iovec *vec,
+    uint32_t *name_len)
 {
-        uint32_t name_len;
         uint64_t t;
 
         /* Make sure the name fits before end of vector.
@@ -67,9 +71,9 @@ smb2_decode_fileidfulldirectoryinformation(
          * that all other fields also fit within the remainder of the
          * vector.
          */
-        smb2_get_uint32(vec, 60, &name_len);
-        if (name_len > 80 + name_len ||
-            80 + name_len > vec->len) {
+        smb2_get_uint32(vec, 60, name_len);
+        if (*name_len > 80 + *name_len ||
+            80 + *name_len > vec->len) {
                 smb2_set_error(smb2, "Malformed name in query.\n");
                 return -1;
         }
@@ -82,7 +86,7 @@ smb2_decode_fileidfulldirectoryinformation(
         smb2_get_uint32(vec, 64, &fs->ea_size);
         smb2_get_uint64(vec, 72, &fs->file_id);
 
-        fs->name = smb2_utf16_to_utf8((uint16_t *)(void *)&vec->buf[80], name_len / 2);
+        fs->name = NULL;
 
         smb2_get_uint64(vec, 8, &t);
         smb2_win_to_timeval(t, &fs->creation_time);
@@ -99,25 +103,40 @@ smb2_decode_fileidfulldirectoryinformation(
         return 0;
 }
 
+int
+smb2_decode_fileidfulldirectoryinformation(
+    struct smb2_context *smb2,
+    struct smb2_fileidfulldirectoryinformation *fs,
+    struct smb2_iovec *vec)
+{
+        uint32_t name_len;
+
+        if (smb2_decode_fileidfulldirectoryinformation_fields(smb2, fs, vec,
+                                                              &name_len) < 0) {
+                return -1;
+        }
+
+        fs->name = smb2_utf16_to_utf8((uint16_t *)(void *)&vec->buf[80], name_len / 2);
+
+        return 0;
+}
+
 static int
 smb2_encode_query_directory_request(struct smb2_context *smb2,
                                     struct smb2_pdu *pdu,
                                     struct smb2_query_directory_request *req)
 {
         int len;
-        uint8_t *buf;
         struct smb2_utf16 *name = NULL;
         struct smb2_iovec *iov;
 
         len = SMB2_QUERY_DIRECTORY_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate query buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         /* Name */
         if (req->name && req->name[0]) {
                 name = smb2_utf8_to_utf16(req->name);
@@ -138,17 +157,13 @@ smb2_encode_query_directory_request(struct smb2_context *smb2,
 
         /* Name */
         if (name) {
-                buf = malloc(2 * name->len);
-                if (buf == NULL) {
+                iov = smb2_add_iovector_alloc(smb2, pdu, 2 * name->len);
+                if (iov == NULL) {
                         smb2_set_error(smb2, "Failed to allocate qdir name");
                         free(name);
                         return -1;
                 }
-                memcpy(buf, &name->val[0], 2 * name->len);
-                iov = smb2_add_iovector(smb2, &pdu->out,
-                                        buf,
-                                        2 * name->len,
-                                        free);
+                memcpy(iov->buf, &name->val[0], 2 * name->len);
         }
         free(name);
 
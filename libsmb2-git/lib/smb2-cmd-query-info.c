@@ -61,7 +61,6 @@ smb2_encode_query_info_request(struct smb2_context *smb2,
                                struct smb2_query_info_request *req)
 {
         int len;
-        uint8_t *buf;
         struct smb2_iovec *iov;
 
         if (req->input_buffer_length > 0) {
@@ -70,14 +69,12 @@ smb2_encode_query_info_request(struct smb2_context *smb2,
         }
 
         len = SMB2_QUERY_INFO_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate query buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_QUERY_INFO_REQUEST_SIZE);
         smb2_set_uint8(iov, 2, req->info_type);
         smb2_set_uint8(iov, 3, req->file_info_class);
@@ -65,14 +65,12 @@ smb2_encode_read_request(struct smb2_context *smb2,
         struct smb2_iovec *iov;
 
         len = SMB2_READ_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate read buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         if (!smb2->supports_multi_credit && req->length > 64 * 1024) {
                 req->length = 64 * 1024;
                 req->minimum_count = 0;
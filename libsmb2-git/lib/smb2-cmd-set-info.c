@@ -70,14 +70,12 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
         struct smb2_utf16 *name;
 
         len = SMB2_SET_INFO_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate set info buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_SET_INFO_REQUEST_SIZE);
         smb2_set_uint8(iov, 2, req->info_type);
         smb2_set_uint8(iov, 3, req->file_info_class);
@@ -108,28 +106,24 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         len = 40;
                         smb2_set_uint32(iov, 4, len); /* buffer length */
 
-                        buf = calloc(len, sizeof(uint8_t));
-                        if (buf == NULL) {
+                        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+                        if (iov == NULL) {
                                 smb2_set_error(smb2, "Failed to allocate set "
                                                "info data buffer");
                                 return -1;
                         }
-                        iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
-                                                free);
                         smb2_encode_file_basic_info(smb2, req->input_data, iov);
                         break;
                 case SMB2_FILE_END_OF_FILE_INFORMATION:
                         len = 8;
                         smb2_set_uint32(iov, 4, len); /* buffer length */
 
-                        buf = calloc(len, sizeof(uint8_t));
-                        if (buf == NULL) {
+                        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+                        if (iov == NULL) {
                                 smb2_set_error(smb2, "Failed to allocate set "
                                                "info data buffer");
                                 return -1;
                         }
-                        iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
-                                                free);
 
                         eofi = req->input_data;
                         smb2_set_uint64(iov, 0, eofi->end_of_file);
@@ -153,15 +147,13 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         len = 20 + name->len * 2;
                         smb2_set_uint32(iov, 4, len); /* buffer length */
 
-                        buf = calloc(len, sizeof(uint8_t));
-                        if (buf == NULL) {
+                        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+                        if (iov == NULL) {
                                 smb2_set_error(smb2, "Failed to allocate set "
                                                "info data buffer");
                                 free(name);
                                 return -1;
                         }
-                        iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
-                                                free);
 
                         smb2_set_uint8(iov, 0, rni->replace_if_exist);
                         smb2_set_uint64(iov, 8, 0u);
@@ -174,14 +166,12 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         len = 1;
                         smb2_set_uint32(iov, 4, len); /* buffer length */
 
-                        buf = calloc(len, sizeof(uint8_t));
-                        if (buf == NULL) {
+                        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+                        if (iov == NULL) {
                                 smb2_set_error(smb2, "Failed to allocate set "
                                                "info data buffer");
                                 return -1;
                         }
-                        iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
-                                                free);
 
                         fdi = req->input_data;
                         smb2_set_uint8(iov, 0, fdi->delete_pending);
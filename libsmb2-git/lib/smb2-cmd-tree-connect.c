@@ -65,15 +65,13 @@ smb2_encode_tree_connect_request(struct smb2_context *smb2,
         struct smb2_iovec *iov;
 
         len = SMB2_TREE_CONNECT_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate tree connect setup "
                                "buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_TREE_CONNECT_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->flags);
         /* path offset */
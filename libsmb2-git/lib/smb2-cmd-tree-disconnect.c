@@ -57,21 +57,18 @@ static int
 smb2_encode_tree_disconnect_request(struct smb2_context *smb2,
                                     struct smb2_pdu *pdu)
 {
-        uint8_t *buf;
         int len;
         struct smb2_iovec *iov;
 
         len = 4;
 
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
+        iov = smb2_add_iovector_alloc(smb2, pdu, len);
+        if (iov == NULL) {
                 smb2_set_error(smb2, "Failed to allocate tree disconnect "
                                "buffer");
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         smb2_set_uint16(iov, 0, SMB2_TREE_DISCONNECT_REQUEST_SIZE);
 
         return 0;
@@ -63,11 +63,34 @@
 #define CBC 1
 
 #include "aes.h"
-#include "sha.h"
-#include "sha-private.h"
+#include "hmac-sha256.h"
 
 #define AES128_KEY_LEN     16
-#define AES_BLOCK_SIZE     16
+
+/*
+ * Per-session signing state. The AES key schedule and the CMAC subkeys
+ * (SMB 3.x) and the hashed HMAC pads (SMB 2.x) only depend on the
+ * signing key, so they are computed once when the key is derived
+ * instead of for every PDU.
+ */
+struct smb2_signing_ctx {
+        struct aes_key aes;
+        uint8_t k1[AES_BLOCK_SIZE];
+        uint8_t k2[AES_BLOCK_SIZE];
+        struct hmac_sha256_key hmac;
+};
+
+/*
+ * Incremental AES-CMAC (RFC 4493). The message can be fed in any number
+ * of pieces, so a PDU is signed straight from its iovecs. The final
+ * block is held back in buf until we know whether it is the last one.
+ */
+struct aes_cmac_ctx {
+        const struct smb2_signing_ctx *sc;
+        uint8_t mac[AES_BLOCK_SIZE];
+        uint8_t buf[AES_BLOCK_SIZE];
+        size_t buf_len;
+};
 
 static
 int aes_cmac_shift_left(uint8_t data[AES128_KEY_LEN])
@@ -100,7 +123,7 @@ void aes_cmac_xor(
 
 static
 void aes_cmac_sub_keys(
-    uint8_t key[AES128_KEY_LEN],
+    const struct aes_key *key,
     uint8_t sub_key1[AES128_KEY_LEN],
     uint8_t sub_key2[AES128_KEY_LEN]
     )
@@ -108,7 +131,7 @@ void aes_cmac_sub_keys(
         uint8_t zero[AES128_KEY_LEN] = {0};
         static const uint8_t rb[AES128_KEY_LEN] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x87};
 
-        AES128_ECB_encrypt(zero, key, sub_key1);
+        AES_encrypt(key, zero, sub_key1);
         if (aes_cmac_shift_left(sub_key1)) {
                 aes_cmac_xor(sub_key1, rb);
         }
@@ -120,47 +143,91 @@ void aes_cmac_sub_keys(
         }
 }
 
-void smb3_aes_cmac_128(uint8_t key[AES128_KEY_LEN],
-                   uint8_t * msg,
-                   uint64_t msg_len,
-                   uint8_t mac[AES128_KEY_LEN]
-                  )
+static
+void aes_cmac_init(struct aes_cmac_ctx *ctx, const struct smb2_signing_ctx *sc)
+{
+        ctx->sc = sc;
+        memset(ctx->mac, 0, AES_BLOCK_SIZE);
+        ctx->buf_len = 0;
+}
+
+static
+void aes_cmac_update(struct aes_cmac_ctx *ctx, const uint8_t *msg, size_t len)
 {
-        uint8_t sub_key1[AES128_KEY_LEN] = {0};
-        uint8_t sub_key2[AES128_KEY_LEN] = {0};
-        uint8_t scratch[AES128_KEY_LEN] = {0};
-        uint64_t n = (msg_len + AES128_KEY_LEN - 1) / AES128_KEY_LEN;
-        uint64_t rem = msg_len % AES128_KEY_LEN;
-        uint64_t i = 0;
-        int is_last_block_complete = n != 0 && rem == 0;
-
-        if (n == 0) {
-                n = 1;
+        size_t n;
+
+        while (len) {
+                /* a full buffered block is only processed once we know
+                 * more data follows it */
+                if (ctx->buf_len == AES_BLOCK_SIZE) {
+                        aes_cmac_xor(ctx->mac, ctx->buf);
+                        AES_encrypt(&ctx->sc->aes, ctx->mac, ctx->mac);
+                        ctx->buf_len = 0;
+                }
+                /* whole blocks that are known not to be the last one */
+                while (ctx->buf_len == 0 && len > AES_BLOCK_SIZE) {
+                        aes_cmac_xor(ctx->mac, msg);
+                        AES_encrypt(&ctx->sc->aes, ctx->mac, ctx->mac);
+                        msg += AES_BLOCK_SIZE;
+                        len -= AES_BLOCK_SIZE;
+                }
+                n = AES_BLOCK_SIZE - ctx->buf_len;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(&ctx->buf[ctx->buf_len], msg, n);
+                ctx->buf_len += n;
+                msg += n;
+                len -= n;
         }
+}
 
-        aes_cmac_sub_keys(key, sub_key1, sub_key2);
+static
+void aes_cmac_final(struct aes_cmac_ctx *ctx, uint8_t mac[AES128_KEY_LEN])
+{
+        if (ctx->buf_len == AES_BLOCK_SIZE) {
+                aes_cmac_xor(ctx->buf, ctx->sc->k1);
+        } else {
+                ctx->buf[ctx->buf_len] = 0x80;
+                memset(&ctx->buf[ctx->buf_len + 1], 0,
+                       AES_BLOCK_SIZE - (ctx->buf_len + 1));
+                aes_cmac_xor(ctx->buf, ctx->sc->k2);
+        }
 
-        memset(mac, 0, AES128_KEY_LEN);
+        aes_cmac_xor(ctx->mac, ctx->buf);
+        AES_encrypt(&ctx->sc->aes, ctx->mac, mac);
+}
 
-        for (i = 0; i < n - 1; i++) {
-                aes_cmac_xor(mac, &msg[i*AES128_KEY_LEN]);
-                AES128_ECB_encrypt(mac, key, scratch);
-                memcpy(mac, scratch, AES128_KEY_LEN);
+void
+smb2_free_signing_ctx(struct smb2_context *smb2)
+{
+        if (smb2->signing_ctx) {
+                memset(smb2->signing_ctx, 0, sizeof(*smb2->signing_ctx));
+                free(smb2->signing_ctx);
+                smb2->signing_ctx = NULL;
         }
+}
 
-        if (is_last_block_complete) {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], AES128_KEY_LEN);
-                aes_cmac_xor(scratch, sub_key1);
-        } else {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], (size_t)rem);
-                scratch[rem] = 0x80;
-                memset(&scratch[rem + 1], 0, AES128_KEY_LEN - ((size_t)rem + 1));
-                aes_cmac_xor(scratch, sub_key2);
+int
+smb2_init_signing_ctx(struct smb2_context *smb2)
+{
+        struct smb2_signing_ctx *sc = smb2->signing_ctx;
+
+        if (sc == NULL) {
+                sc = malloc(sizeof(*sc));
+                if (sc == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate signing "
+                                       "context");
+                        return -ENOMEM;
+                }
+                smb2->signing_ctx = sc;
         }
 
-        aes_cmac_xor(mac, scratch);
-        AES128_ECB_encrypt(mac, key, scratch);
-        memcpy(mac, scratch, AES128_KEY_LEN);
+        AES_set_encrypt_key(&sc->aes, smb2->signing_key, AES128_KEY_LEN);
+        aes_cmac_sub_keys(&sc->aes, sc->k1, sc->k2);
+        hmac_sha256_init_key(&sc->hmac, smb2->signing_key, SMB2_KEY_SIZE);
+
+        return 0;
 }
 
 int
@@ -171,40 +238,32 @@ smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
         /* Clear the smb2 header signature field field */
         memset(iov[0].buf + 48, 0, 16);
 
+        if (smb2->signing_ctx == NULL &&
+            smb2_init_signing_ctx(smb2) < 0) {
+                return -1;
+        }
+
         if (smb2->dialect > SMB2_VERSION_0210) {
-                size_t i = 0;
-                size_t len = 0, offset = 0;
+                struct aes_cmac_ctx ctx;
                 uint8_t aes_mac[AES_BLOCK_SIZE];
-                /* combine the buffers into one */
-                uint8_t *msg = NULL;
-
-                for (i=0; i < niov; i++) {
-                        len += iov[i].len;
-                }
-                msg = (uint8_t *) malloc(len);
-                if (msg == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate buffer for "
-                                       "signature calculation");
-                        return -1;
-                }
+                size_t i;
 
+                aes_cmac_init(&ctx, smb2->signing_ctx);
                 for (i=0; i < niov; i++) {
-                        memcpy(msg + offset, iov[i].buf, iov[i].len);
-                        offset += iov[i].len;
+                        aes_cmac_update(&ctx, iov[i].buf, iov[i].len);
                 }
-                smb3_aes_cmac_128(smb2->signing_key, msg, offset, aes_mac);
-                free(msg);
+                aes_cmac_final(&ctx, aes_mac);
                 memcpy(&signature[0], aes_mac, SMB2_SIGNATURE_SIZE);
         } else {
-                HMACContext ctx;
-                uint8_t digest[USHAMaxHashSize];
+                struct hmac_sha256_ctx ctx;
+                uint8_t digest[HMAC_SHA256_DIGEST_SIZE];
                 size_t i;
 
-                hmacReset(&ctx, SHA256, &smb2->signing_key[0], SMB2_KEY_SIZE);
+                hmac_sha256_start(&ctx, &smb2->signing_ctx->hmac);
                 for (i=0; i < niov; i++) {
-                        hmacInput(&ctx, iov[i].buf, iov[i].len);
+                        hmac_sha256_update(&ctx, iov[i].buf, iov[i].len);
                 }
-                hmacResult(&ctx, digest);
+                hmac_sha256_finish(&ctx, digest);
                 memcpy(&signature[0], digest, SMB2_SIGNATURE_SIZE);
         }
 
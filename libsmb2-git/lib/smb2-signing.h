@@ -36,6 +36,14 @@ extern "C" {
 #include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 
+/* Precompute the per-session signing state from smb2->signing_key.
+ * Must be called again whenever the signing key changes. */
+int
+smb2_init_signing_ctx(struct smb2_context *smb2);
+
+void
+smb2_free_signing_ctx(struct smb2_context *smb2);
+
 int
 smb2_pdu_add_signature(struct smb2_context *smb2,
                        struct smb2_pdu *pdu);
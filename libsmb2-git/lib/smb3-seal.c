@@ -58,6 +58,7 @@
 #include "portable-endian.h"
 
 #include "aes128ccm.h"
+#include "aesgcm.h"
 #include "slist.h"
 #include "smb2.h"
 #include "libsmb2.h"
@@ -67,12 +68,127 @@
 
 static const char xfer[4] = {0xFD, 'S', 'M', 'B'};
 
+int
+smb3_cipher_key_size(uint16_t cipher)
+{
+        switch (cipher) {
+        case SMB2_ENCRYPTION_AES_128_CCM:
+        case SMB2_ENCRYPTION_AES_128_GCM:
+                return 16;
+        case SMB2_ENCRYPTION_AES_256_GCM:
+                return 32;
+        }
+        return 0;
+}
+
+static int
+smb3_is_gcm(struct smb2_context *smb2)
+{
+        return smb2->cypher == SMB2_ENCRYPTION_AES_128_GCM ||
+                smb2->cypher == SMB2_ENCRYPTION_AES_256_GCM;
+}
+
+void
+smb3_free_cipher_keys(struct smb2_context *smb2)
+{
+        free(smb2->serverin_cipher);
+        smb2->serverin_cipher = NULL;
+        free(smb2->serverout_cipher);
+        smb2->serverout_cipher = NULL;
+}
+
+/*
+ * Expand the cipher keys, and for GCM the GHASH tables, once per
+ * session rather than once per PDU.
+ */
+int
+smb3_init_cipher_keys(struct smb2_context *smb2)
+{
+        int key_len = smb3_cipher_key_size(smb2->cypher);
+
+        smb3_free_cipher_keys(smb2);
+        smb2->seal_nonce = 0;
+
+        if (key_len == 0) {
+                return 0;
+        }
+
+        smb2->serverin_cipher = malloc(sizeof(struct aes_gcm_key));
+        smb2->serverout_cipher = malloc(sizeof(struct aes_gcm_key));
+        if (smb2->serverin_cipher == NULL || smb2->serverout_cipher == NULL) {
+                smb2_set_error(smb2, "Failed to allocate cipher keys");
+                smb3_free_cipher_keys(smb2);
+                return -1;
+        }
+        if (smb3_is_gcm(smb2)) {
+                aes_gcm_init_key(smb2->serverin_cipher,
+                                 smb2->serverin_key, key_len);
+                aes_gcm_init_key(smb2->serverout_cipher,
+                                 smb2->serverout_key, key_len);
+        } else {
+                AES_set_encrypt_key(&smb2->serverin_cipher->aes,
+                                    smb2->serverin_key, key_len);
+                AES_set_encrypt_key(&smb2->serverout_cipher->aes,
+                                    smb2->serverout_key, key_len);
+        }
+
+        return 0;
+}
+
+/* Grow a reusable buffer to at least len bytes */
+static uint8_t *
+smb3_grow_buffer(struct smb2_context *smb2, uint8_t **buf, size_t *size,
+                 size_t len)
+{
+        uint8_t *ptr;
+
+        if (len > *size) {
+                ptr = malloc(len);
+                if (ptr == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate %zu bytes "
+                                       "for sealed PDU", len);
+                        return NULL;
+                }
+                free(*buf);
+                *buf = ptr;
+                *size = len;
+        }
+        return *buf;
+}
+
+uint8_t *
+smb3_get_trfm_buffer(struct smb2_context *smb2, size_t len)
+{
+        return smb3_grow_buffer(smb2, &smb2->trfm_buf, &smb2->trfm_buf_size,
+                                len);
+}
+
+void
+smb3_free_buffers(struct smb2_context *smb2)
+{
+        free(smb2->crypt_buf);
+        smb2->crypt_buf = NULL;
+        smb2->crypt_buf_size = 0;
+        free(smb2->trfm_buf);
+        smb2->trfm_buf = NULL;
+        smb2->trfm_buf_size = 0;
+}
+
+/*
+ * Seal a compound chain into the context's crypt buffer. This is done
+ * just before the chain goes out on the socket, so a single buffer is
+ * enough: it is not reused until the chain has been fully written.
+ * With GCM the ciphertext is produced directly from the PDU iovecs.
+ */
 int
 smb3_encrypt_pdu(struct smb2_context *smb2,
                  struct smb2_pdu *pdu)
 {
         struct smb2_pdu *tmp_pdu;
+        struct aes_gcm_ctx gcm;
+        uint8_t *buf;
         uint32_t spl, u32;
+        uint64_t u64;
         int i;
         uint16_t u16;
 
@@ -82,6 +198,10 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
         if (!pdu->seal) {
                 return 0;
         }
+        if (smb2->serverin_cipher == NULL) {
+                smb2_set_error(smb2, "No cipher keys for sealed PDU");
+                return -1;
+        }
 
         spl = 52;  /* transform header */
         for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
@@ -89,36 +209,58 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
                         spl += (uint32_t)tmp_pdu->out.iov[i].len;
                 }
         }
-        pdu->crypt = calloc(spl, sizeof(uint8_t));
-        if (pdu->crypt == NULL) {
-                pdu->seal = 0;
+        buf = smb3_grow_buffer(smb2, &smb2->crypt_buf, &smb2->crypt_buf_size,
+                               spl);
+        if (buf == NULL) {
                 return -1;
         }
+        memset(buf, 0, 52);
 
-        memcpy(&pdu->crypt[0], xfer, 4);
-        for (i = 20; i < 31; i++) {
-                pdu->crypt[i] = random()&0xff;
-        }
+        /* A nonce must never be used twice with the same key, with GCM
+         * that would give away the hash key. A counter is unique by
+         * construction, it fills the first 8 bytes of the 12 byte GCM or
+         * 11 byte CCM nonce and the rest of the field stays zero. */
+        memcpy(&buf[0], xfer, 4);
+        u64 = htole64(++smb2->seal_nonce);
+        memcpy(&buf[20], &u64, 8);
         u32 = htole32(spl - 52);
-        memcpy(&pdu->crypt[36], &u32, 4);
+        memcpy(&buf[36], &u32, 4);
         u16 = htole16(SMB_ENCRYPTION_AES128_CCM);
-        memcpy(&pdu->crypt[42], &u16, 2);
-        memcpy(&pdu->crypt[44], &smb2->session_id, 8);
+        memcpy(&buf[42], &u16, 2);
+        memcpy(&buf[44], &smb2->session_id, 8);
+
+        if (smb3_is_gcm(smb2)) {
+                aes_gcm_start(&gcm, smb2->serverin_cipher, 0,
+                              &buf[20], &buf[20], 32);
+        }
 
         spl = 52;  /* transform header */
         for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
                 for (i = 0; i < tmp_pdu->out.niov; i++) {
-                        memcpy(&pdu->crypt[spl], tmp_pdu->out.iov[i].buf,
-                               tmp_pdu->out.iov[i].len);
+                        if (smb3_is_gcm(smb2)) {
+                                aes_gcm_update(&gcm, tmp_pdu->out.iov[i].buf,
+                                               &buf[spl],
+                                               tmp_pdu->out.iov[i].len);
+                        } else {
+                                memcpy(&buf[spl], tmp_pdu->out.iov[i].buf,
+                                       tmp_pdu->out.iov[i].len);
+                        }
                         spl += (uint32_t)tmp_pdu->out.iov[i].len;
                 }
         }
 
-        aes128ccm_encrypt(smb2->serverin_key,
-                          &pdu->crypt[20], 11,
-                          &pdu->crypt[20], 32,
-                          &pdu->crypt[52], spl - 52,
-                          &pdu->crypt[4], 16);
+        if (smb3_is_gcm(smb2)) {
+                aes_gcm_finish(&gcm, &buf[4]);
+        } else {
+                /* CCM needs the whole plaintext for the MAC before it
+                 * can start encrypting, so it works in place */
+                aes128ccm_encrypt(&smb2->serverin_cipher->aes,
+                                  &buf[20], 11,
+                                  &buf[20], 32,
+                                  &buf[52], spl - 52,
+                                  &buf[4], 16);
+        }
+        pdu->crypt = buf;
         pdu->crypt_len = spl;
 
         return 0;
@@ -127,14 +269,28 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
 int
 smb3_decrypt_pdu(struct smb2_context *smb2)
 {
+        struct smb2_iovec *hdr = &smb2->in.iov[smb2->in.niov - 2];
+        struct smb2_iovec *data = &smb2->in.iov[smb2->in.niov - 1];
+        struct aes_gcm_ctx gcm;
         int rc;
 
-        if (aes128ccm_decrypt(smb2->serverout_key,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[20], 11,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[20], 32,
-                              &smb2->in.iov[smb2->in.niov - 1].buf[0],
-                              smb2->in.iov[smb2->in.niov - 1].len,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[4], 16)) {
+        if (smb2->serverout_cipher == NULL) {
+                smb2_set_error(smb2, "No cipher keys for sealed PDU");
+                return -1;
+        }
+        if (smb3_is_gcm(smb2)) {
+                aes_gcm_start(&gcm, smb2->serverout_cipher, 1,
+                              &hdr->buf[20], &hdr->buf[20], 32);
+                aes_gcm_update(&gcm, data->buf, data->buf, data->len);
+                rc = aes_gcm_check_tag(&gcm, &hdr->buf[4]);
+        } else {
+                rc = aes128ccm_decrypt(&smb2->serverout_cipher->aes,
+                                       &hdr->buf[20], 11,
+                                       &hdr->buf[20], 32,
+                                       data->buf, data->len,
+                                       &hdr->buf[4], 16);
+        }
+        if (rc) {
                 smb2_set_error(smb2, "Failed to decrypt PDU");
                 return -1;
         }
@@ -152,8 +308,9 @@ smb3_decrypt_pdu(struct smb2_context *smb2)
                                   SMB2_HEADER_SIZE, NULL);
         }
 
+        /* smb2->enc points into the context's trfm buffer, which is
+         * kept for the next sealed PDU */
         rc = smb2_read_from_buf(smb2);
-        free(smb2->enc);
         smb2->enc = NULL;
 
         return rc;
@@ -30,6 +30,22 @@
 extern "C" {
 #endif
 
+/* Key length in bytes for a negotiated cipher, 0 if unsupported */
+int
+smb3_cipher_key_size(uint16_t cipher);
+
+int
+smb3_init_cipher_keys(struct smb2_context *smb2);
+
+void
+smb3_free_cipher_keys(struct smb2_context *smb2);
+
+uint8_t *
+smb3_get_trfm_buffer(struct smb2_context *smb2, size_t len);
+
+void
+smb3_free_buffers(struct smb2_context *smb2);
+
 int
 smb3_encrypt_pdu(struct smb2_context *smb2,
                  struct smb2_pdu *pdu);
@@ -233,7 +233,15 @@ smb2_write_to_socket(struct smb2_context *smb2)
                         }
                 }
 
-                if (pdu->seal) {
+                if (pdu->seal && pdu->crypt == NULL) {
+                        if (smb3_encrypt_pdu(smb2, pdu) < 0) {
+                                smb2_set_error(smb2, "Failed to encrypt "
+                                               "pdu: %s", smb2_get_error(smb2));
+                                return -1;
+                        }
+                }
+
+                if (pdu->crypt) {
                         niov = 2;
                         spl = pdu->crypt_len;
                         iov[1].iov_base = pdu->crypt;
@@ -306,9 +314,13 @@ smb2_write_to_socket(struct smb2_context *smb2)
                                 pdu->next_compound = NULL;
 
                                 if (!smb2_is_server(smb2)) {
+                                        if (smb2->trace) {
+                                                smb2_trace_sent(smb2, pdu,
+                                                        (uint32_t)pdu->out.total_size);
+                                        }
                                         smb2->credits -= pdu->header.credit_charge;
                                         /* queue requests we send to correlate replies with */
-                                        SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                                        smb2_waitqueue_add(smb2, pdu);
                                 }
                                 else {
                                         /* alway allow writing replies */
@@ -334,6 +346,7 @@ static int smb2_read_data(struct smb2_context *smb2, read_func func,
         int i, niov, is_chained;
         size_t num_done;
         size_t iov_offset = 0;
+        uint8_t *buf;
         static char smb3tfrm[4] = {0xFD, 'S', 'M', 'B'};
         struct smb2_pdu *pdu = smb2->pdu;
         ssize_t count;
@@ -409,9 +422,11 @@ read_more_data:
                         smb2->in.iov[smb2->in.niov - 1].len = 52;
                         len = smb2->spl - 52;
                         smb2->in.total_size -= 12;
-                        smb2_add_iovector(smb2, &smb2->in,
-                                          malloc(len),
-                                          len, free);
+                        buf = smb3_get_trfm_buffer(smb2, len);
+                        if (buf == NULL) {
+                                return -1;
+                        }
+                        smb2_add_iovector(smb2, &smb2->in, buf, len, NULL);
                         memcpy(smb2->in.iov[smb2->in.niov - 1].buf,
                                &smb2->in.iov[smb2->in.niov - 2].buf[52], 12);
                         smb2->recv_state = SMB2_RECV_TRFM;
@@ -447,7 +462,7 @@ read_more_data:
                         while (count > 0);
 
                         /* put on wait queue so queue_pdu doesn't complain */
-                        SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                        smb2_waitqueue_add(smb2, pdu);
 
                         smb2->in.num_done = 0;
                         pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
@@ -474,6 +489,17 @@ read_more_data:
                         return -1;
                 }
                 if (smb2->hdr.status == SMB2_STATUS_PENDING) {
+                        if (smb2->trace && !smb2_is_server(smb2)) {
+                                struct smb2_pdu *req_pdu;
+
+                                req_pdu = smb2_find_pdu(smb2, smb2->hdr.message_id);
+                                if (req_pdu) {
+                                        smb2_trace_reply(smb2, req_pdu,
+                                                         smb2->hdr.status,
+                                                         smb2->hdr.credit_request_response,
+                                                         smb2->spl);
+                                }
+                        }
                         /* Pending. Just treat the rest of the data as
                          * padding then check for and skip processing below.
                          * We will eventually receive a proper reply for this
@@ -531,7 +557,13 @@ read_more_data:
                                         smb2_set_error(smb2, "no matching PDU found");
                                         return -1;
                                 }
-                                SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
+                                smb2_waitqueue_remove(smb2, pdu);
+                                if (smb2->trace) {
+                                        smb2_trace_reply(smb2, pdu,
+                                                         smb2->hdr.status,
+                                                         smb2->hdr.credit_request_response,
+                                                         smb2->spl);
+                                }
                         } else {
                                 /* oplock and lease break notifications won't have a pdu so make one
                                  * oplock replies (that are NOT notifications, i.e. have a valid message_id)
@@ -741,7 +773,7 @@ read_more_data:
 
         if (smb2_is_server(smb2)) {
                 /* queue requests to correlate our replies we send back later */
-                SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                smb2_waitqueue_add(smb2, pdu);
                 pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
                 smb2->pdu = smb2->next_pdu;
                 smb2->next_pdu = NULL;
@@ -33,6 +33,14 @@
 
 #include <errno.h>
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_UNISTD_H
+#include <sys/unistd.h>
+#endif
+
 #ifdef HAVE_SYS_POLL_H
 #include <sys/poll.h>
 #endif
@@ -60,8 +68,72 @@
 #include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 
-static int wait_for_reply(struct smb2_context *smb2,
-                          struct sync_cb_data *cb_data)
+/*
+ * The short lived sync_cb_data of the sync calls live in a small array
+ * in the context rather than on the heap. The async call gets a cookie
+ * made of the slot index and a generation number instead of a pointer,
+ * and the callbacks look the slot up through it. Once a sync call gives
+ * up waiting it releases the slot, which bumps the generation, so a reply
+ * that still arrives later no longer matches and is simply dropped.
+ */
+#define SYNC_SLOT_BITS 5
+
+static struct sync_cb_data *sync_cb_data_get(struct smb2_context *smb2,
+                                             void **cookie)
+{
+        struct smb2_sync_slot *slot;
+        int i;
+
+        for (i = 0; i < SMB2_SYNC_SLOTS; i++) {
+                slot = &smb2->sync_slots[i];
+                if (slot->in_use) {
+                        continue;
+                }
+                slot->in_use = 1;
+                memset(&slot->cb_data, 0, sizeof(struct sync_cb_data));
+                *cookie = (void *)((slot->generation << SYNC_SLOT_BITS) | i);
+                return &slot->cb_data;
+        }
+
+        smb2_set_error(smb2, "Too many nested sync calls");
+        return NULL;
+}
+
+static struct sync_cb_data *sync_cb_data_find(struct smb2_context *smb2,
+                                              void *cookie)
+{
+        uintptr_t c = (uintptr_t)cookie;
+        struct smb2_sync_slot *slot;
+
+        slot = &smb2->sync_slots[c & ((1 << SYNC_SLOT_BITS) - 1)];
+        if (!slot->in_use || slot->generation != (c >> SYNC_SLOT_BITS)) {
+                return NULL;
+        }
+        return &slot->cb_data;
+}
+
+static void sync_cb_data_put(struct smb2_context *smb2,
+                             struct sync_cb_data *cb_data)
+{
+        struct smb2_sync_slot *slot = (struct smb2_sync_slot *)cb_data;
+
+        slot->in_use = 0;
+        slot->generation = (slot->generation + 1) &
+                ((uintptr_t)-1 >> SYNC_SLOT_BITS);
+}
+
+int smb2_latency_bucket(uint64_t us)
+{
+        int i = 0;
+
+        while (i < SMB2_LATENCY_BUCKETS - 1 && us >= ((uint64_t)1 << i)) {
+                i++;
+        }
+        return i;
+}
+
+static int wait_for_reply_loop(struct smb2_context *smb2,
+                               struct sync_cb_data *cb_data)
 {
         time_t t = time(NULL);
 
@@ -96,6 +168,66 @@ static int wait_for_reply(struct smb2_context *smb2,
         return 0;
 }
 
+/*
+ * Every sync call ends up here, so this is where the time spent on
+ * round trips to the server is accounted, if smb2_set_sync_stats()
+ * enabled it.
+ */
+static int wait_for_reply(struct smb2_context *smb2,
+                          struct sync_cb_data *cb_data)
+{
+        struct smb2_sync_stats *st = &smb2->sync_stats;
+        struct timeval start, end;
+        uint64_t us;
+        int rc;
+
+        if (!st->enabled) {
+                return wait_for_reply_loop(smb2, cb_data);
+        }
+
+        gettimeofday(&start, NULL);
+        rc = wait_for_reply_loop(smb2, cb_data);
+        gettimeofday(&end, NULL);
+
+        us = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+                end.tv_usec - start.tv_usec;
+        if ((int64_t)us < 0) {
+                /* the clock was set back */
+                us = 0;
+        }
+        st->waits++;
+        st->wait_us += us;
+        st->hist[smb2_latency_bucket(us)]++;
+
+        return rc;
+}
+
+int smb2_service_nowait(struct smb2_context *smb2)
+{
+        struct pollfd pfd;
+
+        if (!SMB2_VALID_SOCKET(smb2_get_fd(smb2))) {
+                return 0;
+        }
+
+        for (;;) {
+                memset(&pfd, 0, sizeof(struct pollfd));
+                pfd.fd = smb2_get_fd(smb2);
+                pfd.events = smb2_which_events(smb2);
+
+                if (poll(&pfd, 1, 0) < 0) {
+                        smb2_set_error(smb2, "Poll failed");
+                        return -1;
+                }
+                if (pfd.revents == 0) {
+                        return 0;
+                }
+                if (smb2_service(smb2, pfd.revents) < 0) {
+                        return -1;
+                }
+        }
+}
+
 static void connect_cb(struct smb2_context *smb2, int status,
                        void *command_data, void *private_data)
 {
@@ -174,12 +306,13 @@ int smb2_disconnect_share(struct smb2_context *smb2)
 static void opendir_cb(struct smb2_context *smb2, int status,
                        void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
-        if (status == SMB2_STATUS_SHUTDOWN) {
-                return;
-        }
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
+                if (command_data) {
+                        smb2_closedir(smb2, command_data);
+                }
                 return;
         }
         if (status) {
@@ -189,6 +322,18 @@ static void opendir_cb(struct smb2_context *smb2, int status,
         cb_data->ptr = command_data;
 }
 
+/*
+ * Completion of every later batch, see smb2_fetch_dirents(). The result
+ * is left in dir->status.
+ */
+static void fetch_dirents_cb(struct smb2_context *smb2, int status,
+                             void *command_data, void *private_data)
+{
+        struct sync_cb_data *cb_data = private_data;
+
+        cb_data->is_finished = 1;
+}
+
 struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path)
 {
         int r2;
@@ -199,50 +344,77 @@ struct smb2dir *smb2_opendir_r2(struct smb2_context *smb2, const char *path, int
 {
         struct sync_cb_data *cb_data;
         struct smb2dir *dir;
+        void *cookie;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 *r2 = -1;
                 return NULL;
         }
 
-	if (smb2_opendir_async(smb2, path,
-                               opendir_cb, cb_data) != 0) {
+	if (smb2_opendir_streaming_async(smb2, path,
+                                         opendir_cb, cookie) != 0) {
 		smb2_set_error(smb2, "smb2_opendir_async failed");
-                free(cb_data);
+                sync_cb_data_put(smb2, cb_data);
                 *r2 = -1;
 		return NULL;
 	}
 
 	if (wait_for_reply(smb2, cb_data) < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
-                *r2 = cb_data->status;
-                free(cb_data);
+                sync_cb_data_put(smb2, cb_data);
+                *r2 = -1;
                 return NULL;
         }
 
 	dir = cb_data->ptr;
         *r2 = cb_data->status;
+        sync_cb_data_put(smb2, cb_data);
         if (dir) {
-                /* Give ownership of cb_data to dir. It will be freed when dir is freed */
-                dir->free_cb_data = free;
-        } else {
-                free(cb_data);
+                /* The slot goes back to the context, later batches
+                 * complete through the sync_cb_data in dir */
+                dir->cb = fetch_dirents_cb;
+                dir->cb_data = &dir->sync_cb_data;
         }
         return dir;
 }
 
+/*
+ * Fetch the next batch of a directory opened with smb2_opendir().
+ * dir->cb is fetch_dirents_cb and dir->cb_data the sync_cb_data inside
+ * the dir, so both are reused for every batch.
+ */
+int smb2_fetch_dirents(struct smb2_context *smb2, struct smb2dir *dir,
+                       uint8_t flags)
+{
+        struct sync_cb_data *cb_data = &dir->sync_cb_data;
+
+        cb_data->is_finished = 0;
+        cb_data->status = 0;
+
+        if (smb2_query_dirents_async(smb2, dir, flags) < 0) {
+                dir->status = -ENOMEM;
+                return -1;
+        }
+
+        if (wait_for_reply(smb2, cb_data) < 0) {
+                /* -1 like the other sync calls when the connection is lost */
+                dir->status = -1;
+                return -1;
+        }
+
+        return dir->status < 0 ? -1 : 0;
+}
+
 /*
  * open()
  */
 static void open_cb(struct smb2_context *smb2, int status,
                     void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
-                free(cb_data);
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
 
@@ -259,48 +431,76 @@ struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags)
 struct smb2fh *smb2_open_r2(struct smb2_context *smb2, const char *path, int flags, int *r2)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         void *ptr;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 *r2 = -1;
                 return NULL;
         }
 
 	if (smb2_open_async(smb2, path, flags,
-                               open_cb, cb_data) != 0) {
+                               open_cb, cookie) != 0) {
 		smb2_set_error(smb2, "smb2_open_async failed");
-                free(cb_data);
+                sync_cb_data_put(smb2, cb_data);
                 *r2 = -1;
 		return NULL;
 	}
 
 	if (wait_for_reply(smb2, cb_data) < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
-                *r2 = cb_data->status;
+                sync_cb_data_put(smb2, cb_data);
+                *r2 = SMB2_STATUS_CANCELLED;
                 return NULL;
         }
 
 	ptr = cb_data->ptr;
         *r2 = cb_data->status;
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
         return ptr;
 }
 
+struct smb2fh *smb2_open_dir_handle(struct smb2_context *smb2,
+                                    const char *path)
+{
+        struct sync_cb_data *cb_data;
+        void *cookie;
+        void *ptr;
+
+        cb_data = sync_cb_data_get(smb2, &cookie);
+        if (cb_data == NULL) {
+                return NULL;
+        }
+
+	if (smb2_open_dir_handle_async(smb2, path, open_cb, cookie) != 0) {
+		smb2_set_error(smb2, "smb2_open_dir_handle_async failed");
+                sync_cb_data_put(smb2, cb_data);
+		return NULL;
+	}
+
+	if (wait_for_reply(smb2, cb_data) < 0) {
+                sync_cb_data_put(smb2, cb_data);
+                return NULL;
+        }
+
+	ptr = cb_data->ptr;
+        sync_cb_data_put(smb2, cb_data);
+	return ptr;
+}
+
 /*
  * close()
  */
 static void close_cb(struct smb2_context *smb2, int status,
                     void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
         if (status == SMB2_STATUS_SHUTDOWN) {
                 return;
         }
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
-                free(cb_data);
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
 
@@ -311,30 +511,65 @@ static void close_cb(struct smb2_context *smb2, int status,
 int smb2_close(struct smb2_context *smb2, struct smb2fh *fh)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        /* Outstanding write-behind, read-ahead and pipelined read
+         * callbacks still reference fh */
+        if (fh) {
+                struct smb2_write_behind *wb = smb2_fh_write_behind(fh);
+                struct smb2_read_ahead *ra = smb2_fh_read_ahead(fh);
+                struct smb2_pread_pipeline *pp = smb2_fh_pread_pipeline(fh);
+
+                while (wb->in_flight) {
+                        wb->cb_data.is_finished = 0;
+                        rc = wait_for_reply(smb2, &wb->cb_data);
+                        if (rc < 0) {
+                                goto abandon;
+                        }
+                }
+                while (ra->in_flight) {
+                        ra->cb_data.is_finished = 0;
+                        rc = wait_for_reply(smb2, &ra->cb_data);
+                        if (rc < 0) {
+                                goto abandon;
+                        }
+                }
+                while (pp->in_flight) {
+                        pp->cb_data.is_finished = 0;
+                        rc = wait_for_reply(smb2, &pp->cb_data);
+                        if (rc < 0) {
+                                goto abandon;
+                        }
+                }
+        }
+
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
-	rc = smb2_close_async(smb2, fh, close_cb, cb_data);
+	rc = smb2_close_async(smb2, fh, close_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
                 goto out;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
+
+ abandon:
+        /* the connection is most likely gone, so do not try to close
+         * the file on the server but do not leak the filehandle either */
+        smb2_abandon_fh(smb2, fh);
+        return rc;
 }
 
 /*
@@ -343,10 +578,10 @@ int smb2_close(struct smb2_context *smb2, struct smb2fh *fh)
 static void fsync_cb(struct smb2_context *smb2, int status,
                      void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
-                free(cb_data);
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
 
@@ -357,28 +592,28 @@ static void fsync_cb(struct smb2_context *smb2, int status,
 int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
-	rc = smb2_fsync_async(smb2, fh, fsync_cb, cb_data);
+	rc = smb2_fsync_async(smb2, fh, fsync_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -389,10 +624,10 @@ int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh)
 static void generic_status_cb(struct smb2_context *smb2, int status,
                     void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
-                free(cb_data);
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
 
@@ -404,91 +639,673 @@ int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                uint8_t *buf, uint32_t count, uint64_t offset)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
         
 	rc = smb2_pread_async(smb2, fh, buf, count, offset,
-                              generic_status_cb, cb_data);
+                              generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
 
+/*
+ * Number of credits that are not already spoken for by PDUs still
+ * sitting in the outqueue.
+ */
+static int available_credits(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu, *tmp_pdu;
+        int credits = smb2->credits;
+
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
+                        credits -= tmp_pdu->header.credit_charge;
+                }
+        }
+        return credits;
+}
+
+/*
+ * Size of the next chunk to issue for a pipelined read or write, or 0 if
+ * there are not enough credits left and we have to wait for a reply first.
+ * A request is always allowed when nothing is in flight so that we can
+ * make progress even if the server is stingy with credits.
+ */
+static uint32_t pipeline_chunk_size(struct smb2_context *smb2,
+                                    uint32_t remaining, uint32_t max_size,
+                                    int in_flight)
+{
+        uint32_t count = remaining;
+        int credits, needed_credits;
+
+        if (count > max_size) {
+                count = max_size;
+        }
+        if (smb2->dialect <= SMB2_VERSION_0202) {
+                if (count > 65536) {
+                        count = 65536;
+                }
+                return (in_flight < MAX_CREDITS - 16) ? count : 0;
+        }
+
+        credits = available_credits(smb2);
+        needed_credits = (count - 1) / 65536 + 1;
+        if (needed_credits <= credits) {
+                return count;
+        }
+        if (in_flight) {
+                return 0;
+        }
+        if (credits < 1) {
+                credits = 1;
+        }
+        return credits * 65536;
+}
+
+/*
+ * pread() split into max_read_size chunks that are all kept in flight at
+ * the same time. Replies may complete in any order, each one lands
+ * directly in its own slice of buf. The state lives in the filehandle so
+ * that replies which arrive after we gave up waiting can still be
+ * accounted for.
+ */
+static void pread_pipeline_cb(struct smb2_context *smb2, int status,
+                              void *command_data, void *private_data)
+{
+        struct smb2_read_cb_data *rd = command_data;
+        struct smb2_pread_pipeline *pp = smb2_fh_pread_pipeline(rd->fh);
+
+        pp->in_flight--;
+        pp->cb_data.is_finished = 1;
+
+        if (pp->cb_data.status == SMB2_STATUS_CANCELLED) {
+                return;
+        }
+
+        if (status < 0) {
+                if (pp->cb_data.status == 0) {
+                        pp->cb_data.status = status;
+                }
+        } else if ((uint32_t)status < rd->count) {
+                /* Short read, nothing beyond this point is valid */
+                if (rd->offset + status < pp->end) {
+                        pp->end = rd->offset + status;
+                }
+        }
+}
+
+int smb2_pread_pipelined(struct smb2_context *smb2, struct smb2fh *fh,
+                         uint8_t *buf, uint32_t count, uint64_t offset)
+{
+        struct smb2_pread_pipeline *pp = smb2_fh_pread_pipeline(fh);
+        uint32_t max_read_size, done = 0, len;
+        int rc = 0;
+
+        if (count == 0) {
+                return 0;
+        }
+
+        /* Replies left over from a call that gave up waiting */
+        while (pp->in_flight) {
+                pp->cb_data.is_finished = 0;
+                rc = wait_for_reply(smb2, &pp->cb_data);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+        pp->cb_data.status = 0;
+        pp->end = offset + count;
+
+        max_read_size = smb2_get_max_read_size(smb2);
+
+        for (;;) {
+                while (done < count && pp->cb_data.status == 0 &&
+                       offset + done < pp->end) {
+                        len = pipeline_chunk_size(smb2, count - done,
+                                                  max_read_size,
+                                                  pp->in_flight);
+                        if (len == 0) {
+                                break;
+                        }
+                        rc = smb2_pread_async(smb2, fh, buf + done, len,
+                                              offset + done,
+                                              pread_pipeline_cb, NULL);
+                        if (rc < 0) {
+                                if (pp->cb_data.status == 0) {
+                                        pp->cb_data.status = rc;
+                                }
+                                break;
+                        }
+                        pp->in_flight++;
+                        done += len;
+                }
+
+                if (pp->in_flight == 0) {
+                        break;
+                }
+
+                pp->cb_data.is_finished = 0;
+                rc = wait_for_reply(smb2, &pp->cb_data);
+                if (rc < 0) {
+                        /* Late replies are only counted, see above */
+                        pp->cb_data.status = SMB2_STATUS_CANCELLED;
+                        return rc;
+                }
+        }
+
+        rc = pp->cb_data.status;
+        if (rc == 0) {
+                rc = (int)(pp->end - offset);
+                smb2_lseek(smb2, fh, pp->end, SEEK_SET, NULL);
+        }
+
+        return rc;
+}
+
+/*
+ * Read-ahead. The chunks are a small pool per filehandle, each one with
+ * its own buffer that a read reply lands in directly. A chunk that is
+ * discarded while in flight is marked stale and only recycled once its
+ * reply has arrived. The buffers are freed together with the filehandle,
+ * after smb2_destroy_context has invoked all outstanding callbacks.
+ */
+static void read_ahead_cb(struct smb2_context *smb2, int status,
+                          void *command_data, void *private_data)
+{
+        struct smb2_read_cb_data *rd = command_data;
+        struct smb2_read_ahead *ra = smb2_fh_read_ahead(rd->fh);
+        struct smb2_read_ahead_chunk *c = private_data;
+
+        ra->in_flight--;
+        ra->cb_data.is_finished = 1;
+
+        if (c->state == SMB2_RA_STALE) {
+                c->state = SMB2_RA_EMPTY;
+                return;
+        }
+        c->state = SMB2_RA_DONE;
+
+        if (status < 0) {
+                c->status = status;
+                return;
+        }
+        if ((uint32_t)status < c->len) {
+                c->len = status;
+                if (!ra->eof_known || c->offset + status < ra->eof) {
+                        ra->eof_known = 1;
+                        ra->eof = c->offset + status;
+                }
+        }
+}
+
+/*
+ * Drop all prefetched data. Returns the number of chunks that were
+ * fetched but never read from.
+ */
+static int read_ahead_discard(struct smb2_read_ahead *ra)
+{
+        struct smb2_read_ahead_chunk *c;
+        int i, unused = 0;
+
+        for (i = 0; i < ra->num_chunks; i++) {
+                c = &ra->chunks[i];
+                if (c->state == SMB2_RA_EMPTY ||
+                    c->state == SMB2_RA_STALE) {
+                        continue;
+                }
+                if (!c->used) {
+                        unused++;
+                }
+                c->state = (c->state == SMB2_RA_IN_FLIGHT) ?
+                        SMB2_RA_STALE : SMB2_RA_EMPTY;
+        }
+        ra->eof_known = 0;
+
+        return unused;
+}
+
+static struct smb2_read_ahead_chunk *
+read_ahead_find(struct smb2_read_ahead *ra, uint64_t offset)
+{
+        struct smb2_read_ahead_chunk *c;
+        int i;
+
+        for (i = 0; i < ra->num_chunks; i++) {
+                c = &ra->chunks[i];
+                if (c->state != SMB2_RA_IN_FLIGHT &&
+                    c->state != SMB2_RA_DONE) {
+                        continue;
+                }
+                if (offset >= c->offset && offset < c->offset + c->len) {
+                        return c;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Make sure window chunks starting at offset are either cached or in
+ * flight, as far as free chunks and credits allow.
+ */
+static int read_ahead_fill(struct smb2_context *smb2, struct smb2fh *fh,
+                           struct smb2_read_ahead *ra, uint64_t offset)
+{
+        struct smb2_read_ahead_chunk *c;
+        uint32_t len;
+        int i, ahead = 0, rc;
+
+        /* Recycle whatever the reader has already skipped past */
+        for (i = 0; i < ra->num_chunks; i++) {
+                c = &ra->chunks[i];
+                if (c->offset + c->len > offset) {
+                        continue;
+                }
+                if (c->state == SMB2_RA_DONE) {
+                        c->state = SMB2_RA_EMPTY;
+                } else if (c->state == SMB2_RA_IN_FLIGHT) {
+                        c->state = SMB2_RA_STALE;
+                }
+        }
+
+        while (ahead < ra->window) {
+                if (ra->eof_known && offset >= ra->eof) {
+                        break;
+                }
+                c = read_ahead_find(ra, offset);
+                if (c) {
+                        offset = c->offset + c->len;
+                        ahead++;
+                        continue;
+                }
+
+                for (i = 0; i < ra->num_chunks; i++) {
+                        if (ra->chunks[i].state == SMB2_RA_EMPTY) {
+                                break;
+                        }
+                }
+                if (i == ra->num_chunks) {
+                        break;
+                }
+                c = &ra->chunks[i];
+
+                len = pipeline_chunk_size(smb2, SMB2_READ_AHEAD_CHUNK_SIZE,
+                                          smb2_get_max_read_size(smb2),
+                                          ra->in_flight);
+                if (len == 0) {
+                        break;
+                }
+                if (c->buf == NULL) {
+                        c->buf = malloc(SMB2_READ_AHEAD_CHUNK_SIZE);
+                        if (c->buf == NULL) {
+                                smb2_set_error(smb2, "Failed to allocate "
+                                               "read ahead buffer");
+                                return -ENOMEM;
+                        }
+                }
+                c->offset = offset;
+                c->len = len;
+                c->status = 0;
+                c->used = 0;
+
+                rc = smb2_pread_async(smb2, fh, c->buf, len, offset,
+                                      read_ahead_cb, c);
+                if (rc < 0) {
+                        return rc;
+                }
+                c->state = SMB2_RA_IN_FLIGHT;
+                ra->in_flight++;
+                offset += len;
+                ahead++;
+        }
+
+        return 0;
+}
+
+int smb2_pread_ahead(struct smb2_context *smb2, struct smb2fh *fh,
+                     uint8_t *buf, uint32_t count, uint64_t offset)
+{
+        struct smb2_read_ahead *ra;
+        struct smb2_read_ahead_chunk *c;
+        uint32_t done = 0, len;
+        uint64_t pos;
+        int sequential, waited = 0, rc;
+
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+        ra = smb2_fh_read_ahead(fh);
+
+        if (ra->chunks == NULL) {
+                if (smb2->read_ahead_max == 0) {
+                        return smb2_pread_pipelined(smb2, fh, buf,
+                                                    count, offset);
+                }
+                ra->chunks = calloc(smb2->read_ahead_max,
+                                    sizeof(struct smb2_read_ahead_chunk));
+                if (ra->chunks == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate read "
+                                       "ahead chunks");
+                        return -ENOMEM;
+                }
+                ra->num_chunks = smb2->read_ahead_max;
+                ra->window = 1;
+        }
+
+        sequential = (offset == ra->next_offset);
+        if (!sequential) {
+                /* Prefetching was a waste, be more careful next time */
+                if (read_ahead_discard(ra) && ra->window > 1) {
+                        ra->window /= 2;
+                }
+        } else {
+                rc = read_ahead_fill(smb2, fh, ra, offset);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+
+        while (done < count) {
+                pos = offset + done;
+                if (ra->eof_known && pos >= ra->eof) {
+                        break;
+                }
+                c = read_ahead_find(ra, pos);
+                if (c == NULL) {
+                        break;
+                }
+                if (c->state == SMB2_RA_IN_FLIGHT) {
+                        waited = 1;
+                        ra->cb_data.is_finished = 0;
+                        rc = wait_for_reply(smb2, &ra->cb_data);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        continue;
+                }
+                if (c->status < 0) {
+                        rc = c->status;
+                        read_ahead_discard(ra);
+                        return rc;
+                }
+
+                len = c->offset + c->len - pos;
+                if (len > count - done) {
+                        len = count - done;
+                }
+                memcpy(buf + done, c->buf + (pos - c->offset), len);
+                c->used = 1;
+                done += len;
+                if (pos + len == c->offset + c->len) {
+                        c->state = SMB2_RA_EMPTY;
+                }
+        }
+
+        if (done < count && !(ra->eof_known && offset + done >= ra->eof)) {
+                /* Not prefetched (yet), read the rest directly */
+                waited = 1;
+                rc = smb2_pread_pipelined(smb2, fh, buf + done,
+                                          count - done, offset + done);
+                if (rc < 0) {
+                        return rc;
+                }
+                done += rc;
+        }
+        ra->next_offset = offset + done;
+
+        if (sequential) {
+                /* The reader caught up with us, prefetch further ahead */
+                if (waited && ra->window < ra->num_chunks) {
+                        ra->window *= 2;
+                        if (ra->window > ra->num_chunks) {
+                                ra->window = ra->num_chunks;
+                        }
+                }
+                rc = read_ahead_fill(smb2, fh, ra, ra->next_offset);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+
+        return done;
+}
+
 int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
                 const uint8_t *buf, uint32_t count, uint64_t offset)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_pwrite_async(smb2, fh, buf, count, offset,
-                               generic_status_cb, cb_data);
+                               generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
         rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
 
+/*
+ * Write-behind. Each chunk is sent from its own copy of the data, which
+ * is passed as private_data and freed when the reply arrives. The state
+ * lives in the filehandle, which is only freed after all its writes have
+ * completed (smb2_close drains them and smb2_destroy_context invokes all
+ * callbacks before freeing the filehandles).
+ */
+static void write_behind_cb(struct smb2_context *smb2, int status,
+                            void *command_data, void *private_data)
+{
+        struct smb2_write_cb_data *wd = command_data;
+        struct smb2_write_behind *wb = smb2_fh_write_behind(wd->fh);
+
+        free(private_data);
+        wb->in_flight--;
+        wb->bytes_in_flight -= wd->count;
+        smb2->write_behind_in_flight--;
+
+        if (status >= 0 && (uint32_t)status < wd->count) {
+                status = -EIO;
+        }
+        if (status < 0 && wb->cb_data.status == 0) {
+                wb->cb_data.status = status;
+        }
+        wb->cb_data.is_finished = 1;
+}
+
+static int wait_for_write_behind(struct smb2_context *smb2,
+                                 struct smb2_write_behind *wb)
+{
+        wb->cb_data.is_finished = 0;
+        return wait_for_reply(smb2, &wb->cb_data);
+}
+
+/* Returns and clears the deferred error of a filehandle */
+static int write_behind_status(struct smb2_write_behind *wb)
+{
+        int rc = wb->cb_data.status;
+
+        wb->cb_data.status = 0;
+        return rc;
+}
+
+int smb2_pwrite_behind(struct smb2_context *smb2, struct smb2fh *fh,
+                       const uint8_t *buf, uint32_t count, uint64_t offset)
+{
+        struct smb2_write_behind *wb;
+        uint32_t window, chunk_size, done = 0, len;
+        int rc;
+        uint8_t *copy;
+
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+        wb = smb2_fh_write_behind(fh);
+
+        rc = write_behind_status(wb);
+        if (rc < 0) {
+                return rc;
+        }
+        read_ahead_discard(smb2_fh_read_ahead(fh));
+
+        window = smb2->write_behind_window;
+        chunk_size = smb2_get_max_write_size(smb2);
+        if (window) {
+                /* leave room for several chunks in the window */
+                len = window / 4 > 65536 ? window / 4 : 65536;
+                chunk_size = MIN(chunk_size, len);
+        }
+
+        while (done < count) {
+                len = MIN(count - done, chunk_size);
+                if (wb->in_flight == 0 ||
+                    wb->bytes_in_flight + len <= window) {
+                        len = pipeline_chunk_size(smb2, len, chunk_size,
+                                                  wb->in_flight);
+                } else {
+                        len = 0;
+                }
+                if (len == 0) {
+                        rc = wait_for_write_behind(smb2, wb);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        rc = write_behind_status(wb);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        continue;
+                }
+
+                copy = malloc(len);
+                if (copy == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate write "
+                                       "behind buffer");
+                        return -ENOMEM;
+                }
+                memcpy(copy, buf + done, len);
+
+                rc = smb2_pwrite_async(smb2, fh, copy, len, offset + done,
+                                       write_behind_cb, copy);
+                if (rc < 0) {
+                        free(copy);
+                        return rc;
+                }
+                wb->in_flight++;
+                wb->bytes_in_flight += len;
+                smb2->write_behind_in_flight++;
+                done += len;
+        }
+
+        if (smb2->write_behind_window == 0) {
+                rc = smb2_write_behind_flush(smb2, fh);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+
+        return count;
+}
+
+int smb2_write_behind_wait(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_write_behind *wb;
+        int rc;
+
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+        wb = smb2_fh_write_behind(fh);
+
+        while (wb->in_flight) {
+                rc = wait_for_write_behind(smb2, wb);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+
+        return 0;
+}
+
+int smb2_write_behind_pending(struct smb2_context *smb2)
+{
+        return smb2->write_behind_in_flight;
+}
+
+int smb2_write_behind_flush(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        int rc;
+
+        rc = smb2_write_behind_wait(smb2, fh);
+        if (rc < 0) {
+                return rc;
+        }
+
+        return write_behind_status(smb2_fh_write_behind(fh));
+}
+
 int smb2_read(struct smb2_context *smb2, struct smb2fh *fh,
               uint8_t *buf, uint32_t count)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_read_async(smb2, fh, buf, count,
-                             generic_status_cb, cb_data);
+                             generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
         rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -497,29 +1314,29 @@ int smb2_write(struct smb2_context *smb2, struct smb2fh *fh,
                const uint8_t *buf, uint32_t count)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
         
 	rc = smb2_write_async(smb2, fh, buf, count,
-                              generic_status_cb, cb_data);
+                              generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -527,29 +1344,29 @@ int smb2_write(struct smb2_context *smb2, struct smb2fh *fh,
 int smb2_unlink(struct smb2_context *smb2, const char *path)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_unlink_async(smb2, path,
-                               generic_status_cb, cb_data);
+                               generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -557,29 +1374,29 @@ int smb2_unlink(struct smb2_context *smb2, const char *path)
 int smb2_rmdir(struct smb2_context *smb2, const char *path)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
         
 	rc = smb2_rmdir_async(smb2, path,
-                              generic_status_cb, cb_data);
+                              generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -587,29 +1404,29 @@ int smb2_rmdir(struct smb2_context *smb2, const char *path)
 int smb2_mkdir(struct smb2_context *smb2, const char *path)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_mkdir_async(smb2, path,
-                              generic_status_cb, cb_data);
+                              generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -618,29 +1435,29 @@ int smb2_fstat(struct smb2_context *smb2, struct smb2fh *fh,
                struct smb2_stat_64 *st)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_fstat_async(smb2, fh, st,
-                              generic_status_cb, cb_data);
+                              generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -649,29 +1466,29 @@ int smb2_stat(struct smb2_context *smb2, const char *path,
               struct smb2_stat_64 *st)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_stat_async(smb2, path, st,
-                             generic_status_cb, cb_data);
+                             generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -680,29 +1497,29 @@ int smb2_rename(struct smb2_context *smb2, const char *oldpath,
                 const char *newpath)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_rename_async(smb2, oldpath, newpath,
-                               generic_status_cb, cb_data);
+                               generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -711,29 +1528,29 @@ int smb2_statvfs(struct smb2_context *smb2, const char *path,
                  struct smb2_statvfs *st)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_statvfs_async(smb2, path, st,
-                                generic_status_cb, cb_data);
+                                generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -742,29 +1559,29 @@ int smb2_truncate(struct smb2_context *smb2, const char *path,
                   uint64_t length)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_truncate_async(smb2, path, length,
-                                 generic_status_cb, cb_data);
+                                 generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -773,29 +1590,33 @@ int smb2_ftruncate(struct smb2_context *smb2, struct smb2fh *fh,
                    uint64_t length)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (fh) {
+                read_ahead_discard(smb2_fh_read_ahead(fh));
+        }
+
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
 	rc = smb2_ftruncate_async(smb2, fh, length,
-                                  generic_status_cb, cb_data);
+                                  generic_status_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -808,13 +1629,14 @@ struct readlink_cb_data {
 static void readlink_cb(struct smb2_context *smb2, int status,
                     void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
-        struct readlink_cb_data *rl_data = cb_data->ptr;
-        
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
-                free(cb_data);
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
+        struct readlink_cb_data *rl_data;
+
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
+        rl_data = cb_data->ptr;
 
         cb_data->is_finished = 1;
         cb_data->status = status;
@@ -825,12 +1647,12 @@ int smb2_readlink(struct smb2_context *smb2, const char *path,
                   char *buf, uint32_t len)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         struct readlink_cb_data rl_data _U_;
         int rc = 0;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
@@ -839,20 +1661,20 @@ int smb2_readlink(struct smb2_context *smb2, const char *path,
 
         cb_data->ptr = &rl_data;
 
-	rc = smb2_readlink_async(smb2, path, readlink_cb, cb_data);
+	rc = smb2_readlink_async(smb2, path, readlink_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -860,10 +1682,10 @@ int smb2_readlink(struct smb2_context *smb2, const char *path,
 static void echo_cb(struct smb2_context *smb2, int status,
                     void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
-                free(cb_data);
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
 
@@ -877,6 +1699,7 @@ static void echo_cb(struct smb2_context *smb2, int status,
 int smb2_echo(struct smb2_context *smb2)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         int rc = 0;
 
         if (!SMB2_VALID_SOCKET(smb2->fd)) {
@@ -884,26 +1707,25 @@ int smb2_echo(struct smb2_context *smb2)
                 return -ENOMEM;
         }
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return -ENOMEM;
         }
 
-        rc = smb2_echo_async(smb2, echo_cb, cb_data);
+        rc = smb2_echo_async(smb2, echo_cb, cookie);
         if (rc < 0) {
                 goto out;
 	}
 
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
+                sync_cb_data_put(smb2, cb_data);
                 return rc;
 	}
 
         rc = cb_data->status;
  out:
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
 
 	return rc;
 }
@@ -911,9 +1733,10 @@ int smb2_echo(struct smb2_context *smb2)
 static void sync_notify_change_cb(struct smb2_context *smb2, int status,
                        void *command_data, void *private_data)
 {
-        struct sync_cb_data *cb_data = private_data;
+        struct sync_cb_data *cb_data = sync_cb_data_find(smb2, private_data);
 
-        if (cb_data->status == SMB2_STATUS_CANCELLED) {
+        if (cb_data == NULL) {
+                /* the sync call has already given up on this reply */
                 return;
         }
 
@@ -928,28 +1751,27 @@ static void sync_notify_change_cb(struct smb2_context *smb2, int status,
 struct smb2_file_notify_change_information *smb2_notify_change(struct smb2_context *smb2, const char *path, uint16_t flags, uint32_t filter)
 {
         struct sync_cb_data *cb_data;
+        void *cookie;
         void *ptr;
 
-        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        cb_data = sync_cb_data_get(smb2, &cookie);
         if (cb_data == NULL) {
-                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
                 return NULL;
         }
 
 	if (smb2_notify_change_async(smb2, path, flags, filter, 0,
-                               sync_notify_change_cb, cb_data) != 0) {
+                               sync_notify_change_cb, cookie) != 0) {
 		smb2_set_error(smb2, "smb2_notify_change failed");
-                free(cb_data);
+                sync_cb_data_put(smb2, cb_data);
 		return NULL;
 	}
 
 	if (wait_for_reply(smb2, cb_data) < 0) {
-                cb_data->status = SMB2_STATUS_CANCELLED;
-                free(cb_data);
+                sync_cb_data_put(smb2, cb_data);
                 return NULL;
         }
 
 	ptr = cb_data->ptr;
-        free(cb_data);
+        sync_cb_data_put(smb2, cb_data);
         return ptr;
 }
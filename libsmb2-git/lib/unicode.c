@@ -55,6 +55,128 @@
 #include <libsmb2.h>
 #include "libsmb2-private.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * ASCII fast paths. Almost all file names are plain ASCII, so runs of
+ * 7-bit characters are found and converted 16 bytes (SSE2) or a machine
+ * word at a time, and only what is left goes through the full decoder.
+ * All UTF-16 data is accessed bytewise or via memcpy, so neither host
+ * endianness nor alignment of the buffers matter.
+ */
+#define WORD_ONES  (~0UL / 0xff)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/* Returns the number of leading 7-bit ASCII bytes in s[0..len) */
+static size_t
+utf8_ascii_run(const uint8_t *s, size_t len)
+{
+        unsigned long w;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        for (; i + 16 <= len; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+                if (_mm_movemask_epi8(v)) {
+                        break;
+                }
+        }
+#endif
+        for (; i + sizeof(w) <= len; i += sizeof(w)) {
+                memcpy(&w, s + i, sizeof(w));
+                if (w & WORD_HIGHS) {
+                        break;
+                }
+        }
+        while (i < len && s[i] < 0x80) {
+                i++;
+        }
+        return i;
+}
+
+/* Returns the number of leading UTF-16LE code units below 0x80 */
+static size_t
+utf16_ascii_run(const uint16_t *s, size_t len)
+{
+        static const uint8_t pattern[8] = {
+                0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff
+        };
+        const uint8_t *p = (const uint8_t *)s;
+        unsigned long w, mask;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        /* x86 is little endian, so the units can be tested as words */
+        const __m128i high = _mm_set1_epi16((short)0xff80);
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; i + 8 <= len; i += 8) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + 2 * i));
+                v = _mm_cmpeq_epi16(_mm_and_si128(v, high), zero);
+                if (_mm_movemask_epi8(v) != 0xffff) {
+                        break;
+                }
+        }
+#endif
+        memcpy(&mask, pattern, sizeof(mask));
+        for (; i + sizeof(w) / 2 <= len; i += sizeof(w) / 2) {
+                memcpy(&w, p + 2 * i, sizeof(w));
+                if (w & mask) {
+                        break;
+                }
+        }
+        while (i < len && p[2 * i] < 0x80 && p[2 * i + 1] == 0) {
+                i++;
+        }
+        return i;
+}
+
+/* Widen n ASCII bytes to UTF-16LE */
+static void
+ascii_to_utf16(const uint8_t *src, uint16_t *dst, size_t n)
+{
+        uint8_t *d = (uint8_t *)dst;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; i + 16 <= n; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(src + i));
+                _mm_storeu_si128((__m128i *)(void *)(d + 2 * i),
+                                 _mm_unpacklo_epi8(v, zero));
+                _mm_storeu_si128((__m128i *)(void *)(d + 2 * i + 16),
+                                 _mm_unpackhi_epi8(v, zero));
+        }
+#endif
+        for (; i < n; i++) {
+                d[2 * i] = src[i];
+                d[2 * i + 1] = 0;
+        }
+}
+
+/* Narrow n UTF-16LE code units, all below 0x80, to ASCII */
+static void
+utf16_to_ascii(const uint16_t *src, char *dst, size_t n)
+{
+        const uint8_t *s = (const uint8_t *)src;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        for (; i + 16 <= n; i += 16) {
+                __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(s + 2 * i));
+                __m128i b = _mm_loadu_si128((const __m128i *)(const void *)(s + 2 * i + 16));
+                _mm_storeu_si128((__m128i *)(void *)(dst + i),
+                                 _mm_packus_epi16(a, b));
+        }
+#endif
+        for (; i < n; i++) {
+                dst[i] = (char)s[2 * i];
+        }
+}
+
 /* Count number of leading 1 bits in the char */
 static int
 l1(char c)
@@ -145,14 +267,22 @@ validate_utf8_cp(const char **utf8, uint16_t *ret)
  * Returns >=0 if valid UTF8 and -1 if not.
  */
 static int
-validate_utf8_str(const char *utf8)
+validate_utf8_str(const char *utf8, size_t len)
 {
         const char *u = utf8;
+        const char *end = utf8 + len;
         int i = 0;
         int cp_length;
         uint16_t cp[2];
+        size_t n;
 
-        while (*u) {
+        while (u < end) {
+                n = utf8_ascii_run((const uint8_t *)u, end - u);
+                i += (int)n;
+                u += n;
+                if (u == end) {
+                        break;
+                }
                 cp_length = validate_utf8_cp(&u, cp);
                 if (cp_length < 0) {
                         return -1;
@@ -167,9 +297,11 @@ struct smb2_utf16 *
 smb2_utf8_to_utf16(const char *utf8)
 {
         struct smb2_utf16 *utf16;
+        const char *end = utf8 + strlen(utf8);
         int i, len;
+        size_t n;
 
-        len = validate_utf8_str(utf8);
+        len = validate_utf8_str(utf8, end - utf8);
         if (len < 0) {
                 return NULL;
         }
@@ -182,6 +314,13 @@ smb2_utf8_to_utf16(const char *utf8)
         utf16->len = len;
         i = 0;
         while (i < len) {
+                n = utf8_ascii_run((const uint8_t *)utf8, end - utf8);
+                if (n) {
+                        ascii_to_utf16((const uint8_t *)utf8, &utf16->val[i], n);
+                        utf8 += n;
+                        i += (int)n;
+                        continue;
+                }
                 switch(validate_utf8_cp(&utf8, &utf16->val[i])) {
                 case 1:
                     utf16->val[i] = htole16(utf16->val[i]);
@@ -206,8 +345,18 @@ utf16_size(const uint16_t *utf16, size_t utf16_len)
 {
         int length = 0;
         const uint16_t *utf16_end = utf16 + utf16_len;
+        size_t n;
+
         while (utf16 < utf16_end) {
-                uint32_t code = le16toh(*utf16++);
+                uint32_t code;
+
+                n = utf16_ascii_run(utf16, utf16_end - utf16);
+                length += (int)n;
+                utf16 += n;
+                if (utf16 == utf16_end) {
+                        break;
+                }
+                code = le16toh(*utf16++);
 
                 if (code < 0x80) {
                         length += 1; /* One UTF-16 code unit maps to one UTF-8 code unit */
@@ -241,27 +390,36 @@ utf16_size(const uint16_t *utf16, size_t utf16_len)
         return length;
 }
 
+size_t
+smb2_utf16_utf8_size(const uint16_t *utf16, size_t utf16_len)
+{
+        return utf16_size(utf16, utf16_len);
+}
+
 /*
- * Convert a UTF-16LE string into UTF8
+ * Convert a UTF-16LE string into UTF8 in a caller supplied buffer of
+ * at least smb2_utf16_utf8_size() + 1 bytes. The result is always
+ * NUL terminated.
  */
-const char *
-smb2_utf16_to_utf8(const uint16_t *utf16, size_t utf16_len)
+void
+smb2_utf16_to_utf8_buf(const uint16_t *utf16, size_t utf16_len, char *str)
 {
-        int utf8_len = 1;
-        char *str, *tmp;
+        char *tmp = str;
         const uint16_t *utf16_end;
-        
-        /* How many bytes do we need for utf8 ? */
-        utf8_len += utf16_size(utf16, utf16_len);
-        str = tmp = (char*)malloc(utf8_len);
-        if (str == NULL) {
-                return NULL;
-        }
-        str[utf8_len - 1] = 0;
 
         utf16_end = utf16 + utf16_len;
         while (utf16 < utf16_end) {
-                uint32_t code = le16toh(*utf16++);
+                uint32_t code;
+                size_t n;
+
+                n = utf16_ascii_run(utf16, utf16_end - utf16);
+                utf16_to_ascii(utf16, tmp, n);
+                tmp += n;
+                utf16 += n;
+                if (utf16 == utf16_end) {
+                        break;
+                }
+                code = le16toh(*utf16++);
 
                 if (code < 0x80) {
                         *tmp++ = code; /* One UTF-16 code unit maps to one UTF-8 code unit */
@@ -276,7 +434,8 @@ smb2_utf16_to_utf8(const uint16_t *utf16, size_t utf16_len)
                         uint32_t trail;
                         if (utf16 == utf16_end) { /* It's possible the stream ends with a leading code unit, which is an error */
                                 *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
-                                return str;
+                                *tmp = 0;
+                                return;
                         }
 
                         trail = le16toh(*utf16);
@@ -303,5 +462,25 @@ smb2_utf16_to_utf8(const uint16_t *utf16, size_t utf16_len)
                 }
         }
 
+        *tmp = 0;
+}
+
+/*
+ * Convert a UTF-16LE string into UTF8
+ */
+const char *
+smb2_utf16_to_utf8(const uint16_t *utf16, size_t utf16_len)
+{
+        int utf8_len = 1;
+        char *str;
+
+        /* How many bytes do we need for utf8 ? */
+        utf8_len += utf16_size(utf16, utf16_len);
+        str = (char*)malloc(utf8_len);
+        if (str == NULL) {
+                return NULL;
+        }
+        smb2_utf16_to_utf8_buf(utf16, utf16_len, str);
+
         return str;
 }
@@ -0,0 +1,359 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by the libsmb2 contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Offline decoder for the wire traces written by smb2_dump_trace().
+ * It only needs a C library, build it on the machine the trace is
+ * looked at with e.g.
+ *
+ *   cc -O2 -o smb2-trace smb2-trace.c
+ *
+ * and run it as "smb2-trace [-s] <file>". One line is printed per
+ * request, followed by a summary per command. -s prints only the
+ * summary.
+ *
+ * The file format is described with smb2_dump_trace() in libsmb2.h.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC       "SMB2TRCE"
+#define TRACE_VERSION     1
+#define TRACE_HEADER_SIZE 24
+#define TRACE_RECORD_SIZE 52
+
+#define TRACE_SENT      0x0001
+#define TRACE_REPLIED   0x0002
+#define TRACE_PENDING   0x0004
+#define TRACE_COMPOUND  0x0008
+#define TRACE_SEALED    0x0010
+#define TRACE_TIMEOUT   0x0020
+
+#define NUM_COMMANDS 19
+
+static const char *const command_names[NUM_COMMANDS] = {
+        "NEGOTIATE", "SESSION_SETUP", "LOGOFF", "TREE_CONNECT",
+        "TREE_DISCONNECT", "CREATE", "CLOSE", "FLUSH", "READ", "WRITE",
+        "LOCK", "IOCTL", "CANCEL", "ECHO", "QUERY_DIRECTORY",
+        "CHANGE_NOTIFY", "QUERY_INFO", "SET_INFO", "OPLOCK_BREAK"
+};
+
+struct trace_rec {
+        uint64_t message_id;
+        uint64_t queue_us;
+        uint32_t seq;
+        uint32_t send_us;
+        uint32_t reply_us;
+        uint32_t status;
+        uint32_t out_bytes;
+        uint32_t in_bytes;
+        uint16_t command;
+        uint16_t credit_charge;
+        uint16_t credit_request;
+        uint16_t credit_grant;
+        uint16_t credits;
+        uint16_t flags;
+};
+
+struct command_stats {
+        uint32_t count;
+        uint32_t answered;
+        uint32_t errors;
+        uint64_t bytes_out;
+        uint64_t bytes_in;
+        uint64_t rtt_us;        /* sent to answered */
+        uint32_t max_rtt_us;
+        uint64_t wait_us;       /* queued to sent */
+        uint32_t max_wait_us;
+};
+
+static uint16_t get16(const uint8_t **p)
+{
+        uint16_t v = (*p)[0] | ((*p)[1] << 8);
+
+        *p += 2;
+        return v;
+}
+
+static uint32_t get32(const uint8_t **p)
+{
+        uint32_t v = get16(p);
+
+        return v | ((uint32_t)get16(p) << 16);
+}
+
+static uint64_t get64(const uint8_t **p)
+{
+        uint64_t v = get32(p);
+
+        return v | ((uint64_t)get32(p) << 32);
+}
+
+static void decode_rec(const uint8_t *buf, struct trace_rec *rec)
+{
+        const uint8_t *p = buf;
+
+        rec->message_id     = get64(&p);
+        rec->queue_us       = get64(&p);
+        rec->seq            = get32(&p);
+        rec->send_us        = get32(&p);
+        rec->reply_us       = get32(&p);
+        rec->status         = get32(&p);
+        rec->out_bytes      = get32(&p);
+        rec->in_bytes       = get32(&p);
+        rec->command        = get16(&p);
+        rec->credit_charge  = get16(&p);
+        rec->credit_request = get16(&p);
+        rec->credit_grant   = get16(&p);
+        rec->credits        = get16(&p);
+        rec->flags          = get16(&p);
+}
+
+static const char *command_name(uint16_t command)
+{
+        return command < NUM_COMMANDS ? command_names[command] : "?";
+}
+
+/* One letter per flag, '-' when not set */
+static void flag_string(uint16_t flags, char *str)
+{
+        static const char letters[] = "SRPCET";
+        int i;
+
+        for (i = 0; letters[i]; i++) {
+                str[i] = (flags & (1 << i)) ? letters[i] : '-';
+        }
+        str[i] = '\0';
+}
+
+static void print_rec(const struct trace_rec *rec, uint64_t start_us)
+{
+        char flags[8], send[16], reply[16];
+
+        flag_string(rec->flags, flags);
+        if (rec->flags & TRACE_SENT) {
+                snprintf(send, sizeof(send), "%lu",
+                         (unsigned long)rec->send_us);
+        } else {
+                strcpy(send, "-");
+        }
+        if (rec->flags & (TRACE_REPLIED | TRACE_TIMEOUT)) {
+                snprintf(reply, sizeof(reply), "%lu",
+                         (unsigned long)(rec->reply_us - rec->send_us));
+        } else {
+                strcpy(reply, "-");
+        }
+
+        printf("%10lu %12.3f %-15s %10llu %3u %5u %5u %5u %9s %9s "
+               "%8lu %8lu 0x%08lx %s\n",
+               (unsigned long)rec->seq,
+               (double)(rec->queue_us - start_us) / 1000.0,
+               command_name(rec->command),
+               (unsigned long long)rec->message_id,
+               rec->credit_charge, rec->credit_request, rec->credit_grant,
+               rec->credits, send, reply,
+               (unsigned long)rec->out_bytes, (unsigned long)rec->in_bytes,
+               (unsigned long)rec->status, flags);
+}
+
+static void account_rec(struct command_stats *cs, const struct trace_rec *rec)
+{
+        uint32_t rtt;
+
+        cs->count++;
+        cs->bytes_out += rec->out_bytes;
+        cs->bytes_in += rec->in_bytes;
+        if (rec->flags & TRACE_SENT) {
+                cs->wait_us += rec->send_us;
+                if (rec->send_us > cs->max_wait_us) {
+                        cs->max_wait_us = rec->send_us;
+                }
+        }
+        if ((rec->flags & (TRACE_SENT | TRACE_REPLIED)) ==
+            (TRACE_SENT | TRACE_REPLIED)) {
+                rtt = rec->reply_us - rec->send_us;
+                cs->answered++;
+                cs->rtt_us += rtt;
+                if (rtt > cs->max_rtt_us) {
+                        cs->max_rtt_us = rtt;
+                }
+                /* errors have the severity bits set */
+                if ((rec->status & 0xc0000000) == 0xc0000000) {
+                        cs->errors++;
+                }
+        }
+}
+
+static void print_summary(const struct command_stats *stats,
+                          uint32_t starved, uint64_t starved_us,
+                          uint32_t pending, uint32_t timeouts,
+                          uint32_t unanswered)
+{
+        const struct command_stats *cs;
+        int i;
+
+        printf("\n%-15s %8s %8s %6s %10s %10s %9s %9s %9s %9s\n",
+               "command", "count", "answered", "errors", "kb_out", "kb_in",
+               "avg_rtt", "max_rtt", "avg_wait", "max_wait");
+        for (i = 0; i <= NUM_COMMANDS; i++) {
+                cs = &stats[i];
+                if (cs->count == 0) {
+                        continue;
+                }
+                printf("%-15s %8lu %8lu %6lu %10llu %10llu %9llu %9lu "
+                       "%9llu %9lu\n",
+                       i < NUM_COMMANDS ? command_names[i] : "other",
+                       (unsigned long)cs->count,
+                       (unsigned long)cs->answered,
+                       (unsigned long)cs->errors,
+                       (unsigned long long)(cs->bytes_out >> 10),
+                       (unsigned long long)(cs->bytes_in >> 10),
+                       (unsigned long long)(cs->answered ?
+                                            cs->rtt_us / cs->answered : 0),
+                       (unsigned long)cs->max_rtt_us,
+                       (unsigned long long)(cs->wait_us / cs->count),
+                       (unsigned long)cs->max_wait_us);
+        }
+
+        printf("\nqueued without enough credits: %lu, waited %llu us "
+               "in total\n", (unsigned long)starved,
+               (unsigned long long)starved_us);
+        printf("interim pending replies: %lu\n", (unsigned long)pending);
+        printf("timed out: %lu\n", (unsigned long)timeouts);
+        printf("not answered when dumped: %lu\n", (unsigned long)unanswered);
+}
+
+static void usage(void)
+{
+        fprintf(stderr, "usage: smb2-trace [-s] <file>\n"
+                "  -s  print only the summary\n\n"
+                "times are in microseconds: wait is from queued to sent, "
+                "rtt from sent to answered\n"
+                "flags: S sent, R replied, P interim pending reply, "
+                "C compound, E encrypted, T timed out\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct command_stats stats[NUM_COMMANDS + 1];
+        struct trace_rec rec;
+        uint8_t buf[TRACE_RECORD_SIZE];
+        const uint8_t *p;
+        const char *path = NULL;
+        uint32_t version, rec_size, count, last_seq, i;
+        uint32_t starved = 0, pending = 0, timeouts = 0, unanswered = 0;
+        uint64_t starved_us = 0, start_us = 0;
+        int summary_only = 0;
+        FILE *fh;
+
+        for (i = 1; i < (uint32_t)argc; i++) {
+                if (!strcmp(argv[i], "-s")) {
+                        summary_only = 1;
+                } else if (path == NULL) {
+                        path = argv[i];
+                } else {
+                        usage();
+                }
+        }
+        if (path == NULL) {
+                usage();
+        }
+
+        fh = fopen(path, "rb");
+        if (fh == NULL) {
+                perror(path);
+                return 1;
+        }
+
+        if (fread(buf, TRACE_HEADER_SIZE, 1, fh) != 1 ||
+            memcmp(buf, TRACE_MAGIC, 8)) {
+                fprintf(stderr, "%s: not a libsmb2 trace\n", path);
+                fclose(fh);
+                return 1;
+        }
+        p = buf + 8;
+        version = get32(&p);
+        rec_size = get32(&p);
+        count = get32(&p);
+        last_seq = get32(&p);
+        if (version != TRACE_VERSION || rec_size < TRACE_RECORD_SIZE) {
+                fprintf(stderr, "%s: unsupported trace version %lu\n",
+                        path, (unsigned long)version);
+                fclose(fh);
+                return 1;
+        }
+
+        if (last_seq > count) {
+                printf("%lu older records were overwritten\n",
+                       (unsigned long)(last_seq - count));
+        }
+
+        memset(stats, 0, sizeof(stats));
+        if (!summary_only) {
+                printf("%10s %12s %-15s %10s %3s %5s %5s %5s %9s %9s "
+                       "%8s %8s %10s %s\n",
+                       "seq", "queued_ms", "command", "msg_id", "chg",
+                       "req", "grant", "have", "wait", "rtt",
+                       "out", "in", "status", "flags");
+        }
+
+        for (i = 0; i < count; i++) {
+                if (fread(buf, TRACE_RECORD_SIZE, 1, fh) != 1) {
+                        fprintf(stderr, "%s: truncated after %lu "
+                                "records\n", path, (unsigned long)i);
+                        break;
+                }
+                /* later versions may append fields */
+                if (rec_size > TRACE_RECORD_SIZE &&
+                    fseek(fh, rec_size - TRACE_RECORD_SIZE, SEEK_CUR)) {
+                        break;
+                }
+                decode_rec(buf, &rec);
+
+                if (i == 0) {
+                        start_us = rec.queue_us;
+                }
+                if (!summary_only) {
+                        print_rec(&rec, start_us);
+                }
+
+                account_rec(&stats[rec.command < NUM_COMMANDS ?
+                                   rec.command : NUM_COMMANDS], &rec);
+                if (rec.credits < rec.credit_charge) {
+                        starved++;
+                        if (rec.flags & TRACE_SENT) {
+                                starved_us += rec.send_us;
+                        }
+                }
+                if (rec.flags & TRACE_PENDING) {
+                        pending++;
+                }
+                if (rec.flags & TRACE_TIMEOUT) {
+                        timeouts++;
+                } else if (!(rec.flags & TRACE_REPLIED)) {
+                        unanswered++;
+                }
+        }
+        fclose(fh);
+
+        print_summary(stats, starved, starved_us, pending, timeouts,
+                      unanswered);
+        return 0;
+}
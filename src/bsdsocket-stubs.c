@@ -41,11 +41,19 @@ int connect(int sock, const struct sockaddr *addr, socklen_t addrlen)
 	return ISocket->connect(sock, (struct sockaddr *)addr, addrlen);
 }
 
-ssize_t readv(int sock, const struct iovec *iov, int iovcnt)
+/* Staging buffer for the copying fallback below. It is kept between
+ * calls and only grows, so that bulk transfers do not allocate a new
+ * buffer for every PDU. It comes from the memory pool, which is freed
+ * when the handler exits. */
+static char *staging_buffer;
+static size_t staging_size;
+
+/* Cleared if the stack turns out not to implement sendmsg()/recvmsg(). */
+static int use_msg_calls = 1;
+
+static ssize_t iov_total(const struct iovec *iov, int iovcnt)
 {
-	size_t total, left, copylen;
-	char *buffer, *bp;
-	ssize_t rc;
+	size_t total;
 	int i;
 
 	total = 0;
@@ -59,23 +67,68 @@ ssize_t readv(int sock, const struct iovec *iov, int iovcnt)
 		total += iov[i].iov_len;
 	}
 
-	buffer = malloc(total);
-	if (buffer == NULL)
+	return total;
+}
+
+static char *get_staging_buffer(size_t size)
+{
+	char *buffer;
+
+	if (size > staging_size)
 	{
-		errno = ENOMEM;
+		buffer = malloc(size);
+		if (buffer == NULL)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		free(staging_buffer);
+		staging_buffer = buffer;
+		staging_size = size;
+	}
+
+	return staging_buffer;
+}
+
+ssize_t readv(int sock, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	size_t left, copylen;
+	ssize_t total, rc;
+	char *buffer, *bp;
+	int i;
+
+	if (iovcnt == 1)
+		return ISocket->recv(sock, iov[0].iov_base, iov[0].iov_len, 0);
+
+	total = iov_total(iov, iovcnt);
+	if (total < 0)
 		return -1;
+
+	if (use_msg_calls)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = (struct iovec *)iov;
+		msg.msg_iovlen = iovcnt;
+
+		rc = ISocket->recvmsg(sock, &msg, 0);
+		if (rc >= 0 || errno != ENOSYS)
+			return rc;
+
+		use_msg_calls = 0;
 	}
 
+	buffer = get_staging_buffer(total);
+	if (buffer == NULL)
+		return -1;
+
 	rc = ISocket->recv(sock, buffer, total, 0);
 	if (rc < 0)
-	{
-		free(buffer);
 		return -1;
-	}
 
 	bp = buffer;
 	left = rc;
-	for (i = 0; i < iovcnt; i++)
+	for (i = 0; i < iovcnt && left != 0; i++)
 	{
 		copylen = iov[i].iov_len;
 		if (copylen > left)
@@ -84,63 +137,50 @@ ssize_t readv(int sock, const struct iovec *iov, int iovcnt)
 		memcpy(iov[i].iov_base, bp, copylen);
 		bp += copylen;
 		left -= copylen;
-		if (left == 0)
-			break;
 	}
 
-	free(buffer);
 	return rc;
 }
 
 ssize_t writev(int sock, const struct iovec *iov, int iovcnt)
 {
-	size_t total, left, copylen;
+	struct msghdr msg;
+	ssize_t total, rc;
 	char *buffer, *bp;
-	ssize_t rc;
 	int i;
 
-	total = 0;
-	for (i = 0; i < iovcnt; i++)
+	if (iovcnt == 1)
+		return ISocket->send(sock, iov[0].iov_base, iov[0].iov_len, 0);
+
+	total = iov_total(iov, iovcnt);
+	if (total < 0)
+		return -1;
+
+	if (use_msg_calls)
 	{
-		if (iov[i].iov_len > (SSIZE_MAX - total))
-		{
-			errno = EINVAL;
-			return -1;
-		}
-		total += iov[i].iov_len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = (struct iovec *)iov;
+		msg.msg_iovlen = iovcnt;
+
+		rc = ISocket->sendmsg(sock, &msg, 0);
+		if (rc >= 0 || errno != ENOSYS)
+			return rc;
+
+		use_msg_calls = 0;
 	}
 
-	buffer = malloc(total);
+	buffer = get_staging_buffer(total);
 	if (buffer == NULL)
-	{
-		errno = ENOMEM;
 		return -1;
-	}
 
 	bp = buffer;
-	left = total;
 	for (i = 0; i < iovcnt; i++)
 	{
-		copylen = iov[i].iov_len;
-		if (copylen > left)
-			copylen = left;
-
-		memcpy(bp, iov[i].iov_base, copylen);
-		bp += copylen;
-		left -= copylen;
-		if (left == 0)
-			break;
+		memcpy(bp, iov[i].iov_base, iov[i].iov_len);
+		bp += iov[i].iov_len;
 	}
 
-	rc = ISocket->send(sock, buffer, total, 0);
-	if (rc < 0)
-	{
-		free(buffer);
-		return -1;
-	}
-
-	free(buffer);
-	return rc;
+	return ISocket->send(sock, buffer, total, 0);
 }
 
 int setsockopt(int sock, int level, int optname, const void *optval, socklen_t optlen)
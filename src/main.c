@@ -35,10 +35,13 @@
 #include <smb2/libsmb2.h>
 
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #ifdef __amigaos4__
 #include <unistd.h>
 #else
@@ -60,7 +63,15 @@ static const char cmd_template[] =
 	"READONLY/S,"
 	"NOPASSWORDREQ/S,"
 	"NOHANDLESRCV/S,"
-	"RECONNECTREQ/S";
+	"RECONNECTREQ/S,"
+	"WRITEBEHIND/K/N,"
+	"READAHEAD/K/N,"
+	"ATTRCACHETTL/K/N,"
+	"DIRCACHE/K/N,"
+	"DIRBUFFER/K/N,"
+	"STATS/S,"
+	"TRACE/K/N,"
+	"TRACEFILE/K";
 
 enum {
 	ARG_URL,
@@ -72,9 +83,27 @@ enum {
 	ARG_NOPASSWORDREQ,
 	ARG_NO_HANDLES_RCV,
 	ARG_RECONNECT_REQ,
+	ARG_WRITE_BEHIND,
+	ARG_READ_AHEAD,
+	ARG_ATTR_CACHE_TTL,
+	ARG_DIR_CACHE,
+	ARG_DIR_BUFFER,
+	ARG_STATS,
+	ARG_TRACE,
+	ARG_TRACE_FILE,
 	NUM_ARGS
 };
 
+/* Each read-ahead chunk is 64 KB of memory per open file, and the
+   write-behind window, in KB, is held as copies per open file */
+#if defined(__amigaos4__) || defined(__AROS__)
+#define READ_AHEAD_DEFAULT 4
+#define WRITE_BEHIND_DEFAULT 1024
+#else
+#define READ_AHEAD_DEFAULT 2
+#define WRITE_BEHIND_DEFAULT 256
+#endif
+
 struct smb2fs_mount_data {
 	char          *device;
 	struct RDArgs *rda;
@@ -85,22 +114,707 @@ struct smb2fs_mount_data {
 #endif
 };
 
+#define ATTR_CACHE_HASH_SIZE 256
+#define ATTR_CACHE_MAX_ENTRIES 2048
+
+struct attr_cache_entry {
+	struct attr_cache_entry *next;
+	uint32_t                 hash;
+	time_t                   stamp;
+	struct fbx_stat          st;
+	char                     path[];
+};
+
+#define NEG_CACHE_HASH_SIZE 64
+#define NEG_CACHE_MAX_ENTRIES 256
+#define NEG_CACHE_TTL 2
+
+/* hash is that of the parent directory, so a directory's entries share a chain */
+struct neg_cache_entry {
+	struct neg_cache_entry *next;
+	uint32_t                hash;
+	time_t                  stamp;
+	size_t                  parent_len;
+	char                    path[];
+};
+
+#define DIR_CACHE_MAX_ENTRIES 10000
+
+struct dir_cache_entry {
+	char           *name;
+	struct fbx_stat st;
+};
+
+/*
+ * A cached directory listing. It stays coherent for as long as the
+ * change notify request on watch_fh is outstanding, any notification
+ * marks it incomplete so the next opendir reads it again.
+ */
+struct dir_cache {
+	struct dir_cache       *next;
+	struct smb2fh          *watch_fh;
+	BOOL                    watching:1;
+	BOOL                    complete:1;
+	BOOL                    detached:1;
+	int                     refs;
+	uint32_t                generation;
+	struct dir_cache_entry *entries;
+	int                     num_entries;
+	int                     max_entries;
+	char                    path[];
+};
+
+/* What fi->fh of an open file points to */
+struct smb2fs_file {
+	struct smb2fh *smb2fh;
+	BOOL           written:1; /* the directory listing was invalidated */
+};
+
+/* What fi->fh of an open directory points to */
+struct smb2fs_dir {
+	struct smb2dir   *smb2dir; /* NULL when served from dc */
+	struct dir_cache *dc;      /* listing being served or filled */
+	uint32_t          generation;
+};
+
 struct smb2fs {
 	struct smb2_context *smb2;
 	struct PointerHandleRegistry *phr;
 	BOOL                 rdonly:1;
 	BOOL                 connected:1;
 	char                *rootdir;
+	struct attr_cache_entry *attr_cache[ATTR_CACHE_HASH_SIZE];
+	int                  attr_cache_entries;
+	struct neg_cache_entry *neg_cache[NEG_CACHE_HASH_SIZE];
+	int                  neg_cache_entries;
+	struct dir_cache    *dir_cache;
+	int                  dir_cache_count;
 };
 
 struct smb2fs *fsd;
 uint32_t phr_incarnation = 1;
 BOOL cfg_reconnect_req = FALSE;
 BOOL cfg_handles_rcv = TRUE; // recover handles (experimental)
+LONG cfg_write_behind = WRITE_BEHIND_DEFAULT; // kb of writes left in flight per file handle
+LONG cfg_read_ahead = READ_AHEAD_DEFAULT; // max. 64kb chunks prefetched per file handle
+LONG cfg_attr_cache_ttl = 2; // seconds, 0 disables the attribute cache
+LONG cfg_dir_cache = 16; // directory listings kept, 0 disables the cache
+LONG cfg_dir_buffer = 256; // kb requested per directory listing round trip
+LONG cfg_trace = 0; // requests kept in the wire trace, 0 disables it
+BOOL cfg_stats = FALSE; // time the round trips for the statistics file
+const char *cfg_trace_file = "T:smb2-trace";
 char last_server[128];
+uint32_t reconnect_count; // successful reconnects since the handler was started
 
 static void smb2fs_destroy(void *initret);
 
+/*
+ * Paths are compared case insensitively by the caches below, same as
+ * the server does.
+ */
+static uint32_t path_hash(const char *path, size_t len)
+{
+	uint32_t hash = 5381;
+
+	while (len-- != 0)
+		hash = (hash * 33) ^ (uint8_t)tolower((uint8_t)*path++);
+
+	return hash;
+}
+
+/* Length of the parent directory part of path, "" being the root */
+static size_t path_parent_len(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return (slash != NULL) ? (size_t)(slash - path) : 0;
+}
+
+/*
+ * Attribute cache, keyed by the path as passed in by filesysbox.
+ */
+
+static struct attr_cache_entry **attr_cache_find(const char *path, uint32_t hash)
+{
+	struct attr_cache_entry **pentry;
+
+	pentry = &fsd->attr_cache[hash % ATTR_CACHE_HASH_SIZE];
+	while (*pentry != NULL)
+	{
+		if ((*pentry)->hash == hash && strcasecmp((*pentry)->path, path) == 0)
+			break;
+		pentry = &(*pentry)->next;
+	}
+
+	return pentry;
+}
+
+static void attr_cache_flush(void)
+{
+	struct attr_cache_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < ATTR_CACHE_HASH_SIZE; i++)
+	{
+		for (entry = fsd->attr_cache[i]; entry != NULL; entry = next)
+		{
+			next = entry->next;
+			free(entry);
+		}
+		fsd->attr_cache[i] = NULL;
+	}
+	fsd->attr_cache_entries = 0;
+}
+
+/*
+ * Makes room for one more entry by dropping the one stored longest ago
+ * in the chain it is going into, or else the next non-empty chain. The
+ * chains are short, and unlike flushing everything this keeps what a
+ * big listing has just primed.
+ */
+static void attr_cache_evict(uint32_t hash)
+{
+	struct attr_cache_entry **pentry, **poldest, *entry;
+	int i;
+
+	for (i = 0; i < ATTR_CACHE_HASH_SIZE; i++)
+	{
+		poldest = NULL;
+		pentry = &fsd->attr_cache[(hash + i) % ATTR_CACHE_HASH_SIZE];
+		for (; *pentry != NULL; pentry = &(*pentry)->next)
+		{
+			if (poldest == NULL || (*pentry)->stamp < (*poldest)->stamp)
+				poldest = pentry;
+		}
+		if (poldest != NULL)
+		{
+			entry = *poldest;
+			*poldest = entry->next;
+			free(entry);
+			fsd->attr_cache_entries--;
+			return;
+		}
+	}
+}
+
+static BOOL attr_cache_lookup(const char *path, struct fbx_stat *stbuf)
+{
+	struct attr_cache_entry **pentry, *entry;
+
+	if (cfg_attr_cache_ttl <= 0)
+		return FALSE;
+
+	pentry = attr_cache_find(path, path_hash(path, strlen(path)));
+	entry = *pentry;
+	if (entry == NULL)
+		return FALSE;
+
+	if ((time(NULL) - entry->stamp) >= cfg_attr_cache_ttl)
+	{
+		*pentry = entry->next;
+		free(entry);
+		fsd->attr_cache_entries--;
+		return FALSE;
+	}
+
+	*stbuf = entry->st;
+	return TRUE;
+}
+
+static void attr_cache_store(const char *path, const struct fbx_stat *stbuf)
+{
+	struct attr_cache_entry **pentry, *entry;
+	uint32_t hash;
+
+	if (cfg_attr_cache_ttl <= 0)
+		return;
+
+	/* The size may not include writes still in flight on an open handle,
+	   don't keep it around for the whole ttl */
+	if (smb2_write_behind_pending(fsd->smb2) != 0)
+		return;
+
+	hash = path_hash(path, strlen(path));
+	pentry = attr_cache_find(path, hash);
+	entry = *pentry;
+	if (entry == NULL)
+	{
+		if (fsd->attr_cache_entries >= ATTR_CACHE_MAX_ENTRIES)
+		{
+			attr_cache_evict(hash);
+			/* the evicted entry may have been the one before *pentry */
+			pentry = attr_cache_find(path, hash);
+		}
+
+		entry = malloc(sizeof(*entry) + strlen(path) + 1);
+		if (entry == NULL)
+			return;
+
+		entry->next = NULL;
+		entry->hash = hash;
+		strcpy(entry->path, path);
+		*pentry = entry;
+		fsd->attr_cache_entries++;
+	}
+
+	entry->stamp = time(NULL);
+	entry->st    = *stbuf;
+}
+
+/* Drops path and its parent directory, whose timestamps change with it */
+static void attr_cache_invalidate(const char *path)
+{
+	struct attr_cache_entry **pentry, *entry;
+	char parent[MAXPATHLEN];
+	char *slash;
+
+	if (fsd->attr_cache_entries == 0)
+		return;
+
+	pentry = attr_cache_find(path, path_hash(path, strlen(path)));
+	if ((entry = *pentry) != NULL)
+	{
+		*pentry = entry->next;
+		free(entry);
+		fsd->attr_cache_entries--;
+	}
+
+	strlcpy(parent, path, sizeof(parent));
+	slash = strrchr(parent, '/');
+	if (slash == NULL)
+		return;
+	if (slash == parent)
+		slash++; /* Keep the root directory "/" */
+	*slash = '\0';
+
+	pentry = attr_cache_find(parent, path_hash(parent, strlen(parent)));
+	if ((entry = *pentry) != NULL)
+	{
+		*pentry = entry->next;
+		free(entry);
+		fsd->attr_cache_entries--;
+	}
+}
+
+/* Same as attr_cache_invalidate() but also drops everything below path */
+static void attr_cache_invalidate_tree(const char *path)
+{
+	struct attr_cache_entry **pentry, *entry;
+	size_t len = strlen(path);
+	int i;
+
+	attr_cache_invalidate(path);
+
+	for (i = 0; i < ATTR_CACHE_HASH_SIZE && fsd->attr_cache_entries != 0; i++)
+	{
+		pentry = &fsd->attr_cache[i];
+		while ((entry = *pentry) != NULL)
+		{
+			if (strncasecmp(entry->path, path, len) == 0 && entry->path[len] == '/')
+			{
+				*pentry = entry->next;
+				free(entry);
+				fsd->attr_cache_entries--;
+			}
+			else
+				pentry = &entry->next;
+		}
+	}
+}
+
+/*
+ * Negative lookup cache for paths that getattr found not to exist, keyed
+ * by parent directory plus name. Shares its on/off switch with the
+ * attribute cache but always uses a short TTL, as nonexistent names are
+ * mostly probes that are repeated in quick succession.
+ */
+static void neg_cache_flush(void)
+{
+	struct neg_cache_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < NEG_CACHE_HASH_SIZE; i++)
+	{
+		for (entry = fsd->neg_cache[i]; entry != NULL; entry = next)
+		{
+			next = entry->next;
+			free(entry);
+		}
+		fsd->neg_cache[i] = NULL;
+	}
+	fsd->neg_cache_entries = 0;
+}
+
+static BOOL neg_cache_lookup(const char *path)
+{
+	struct neg_cache_entry **pentry, *entry;
+	size_t   parent_len;
+	uint32_t hash;
+	time_t   now;
+
+	if (cfg_attr_cache_ttl <= 0 || fsd->neg_cache_entries == 0)
+		return FALSE;
+
+	parent_len = path_parent_len(path);
+	hash = path_hash(path, parent_len);
+	now = time(NULL);
+
+	pentry = &fsd->neg_cache[hash % NEG_CACHE_HASH_SIZE];
+	while ((entry = *pentry) != NULL)
+	{
+		if ((now - entry->stamp) >= NEG_CACHE_TTL)
+		{
+			*pentry = entry->next;
+			free(entry);
+			fsd->neg_cache_entries--;
+			continue;
+		}
+		if (entry->hash == hash && entry->parent_len == parent_len && strcasecmp(entry->path, path) == 0)
+			return TRUE;
+		pentry = &entry->next;
+	}
+
+	return FALSE;
+}
+
+static void neg_cache_store(const char *path)
+{
+	struct neg_cache_entry *entry;
+	size_t   parent_len;
+	uint32_t hash;
+
+	if (cfg_attr_cache_ttl <= 0)
+		return;
+
+	if (fsd->neg_cache_entries >= NEG_CACHE_MAX_ENTRIES)
+		neg_cache_flush();
+
+	entry = malloc(sizeof(*entry) + strlen(path) + 1);
+	if (entry == NULL)
+		return;
+
+	parent_len = path_parent_len(path);
+	hash = path_hash(path, parent_len);
+
+	entry->hash       = hash;
+	entry->stamp      = time(NULL);
+	entry->parent_len = parent_len;
+	strcpy(entry->path, path);
+	entry->next = fsd->neg_cache[hash % NEG_CACHE_HASH_SIZE];
+	fsd->neg_cache[hash % NEG_CACHE_HASH_SIZE] = entry;
+	fsd->neg_cache_entries++;
+}
+
+/*
+ * Drops the entries of the directory that path was created in. With tree
+ * set, the entries of path itself and everything below it go as well,
+ * for when a directory appears (mkdir, rename).
+ */
+static void neg_cache_invalidate(const char *path, BOOL tree)
+{
+	struct neg_cache_entry **pentry, *entry;
+	size_t   parent_len, len;
+	uint32_t hash;
+	int      i;
+
+	if (fsd->neg_cache_entries == 0)
+		return;
+
+	parent_len = path_parent_len(path);
+	hash = path_hash(path, parent_len);
+
+	pentry = &fsd->neg_cache[hash % NEG_CACHE_HASH_SIZE];
+	while ((entry = *pentry) != NULL)
+	{
+		if (entry->hash == hash && entry->parent_len == parent_len && strncasecmp(entry->path, path, parent_len) == 0)
+		{
+			*pentry = entry->next;
+			free(entry);
+			fsd->neg_cache_entries--;
+		}
+		else
+			pentry = &entry->next;
+	}
+
+	if (!tree)
+		return;
+
+	len = strlen(path);
+	for (i = 0; i < NEG_CACHE_HASH_SIZE && fsd->neg_cache_entries != 0; i++)
+	{
+		pentry = &fsd->neg_cache[i];
+		while ((entry = *pentry) != NULL)
+		{
+			if (strncasecmp(entry->path, path, len) == 0 && entry->path[len] == '/')
+			{
+				*pentry = entry->next;
+				free(entry);
+				fsd->neg_cache_entries--;
+			}
+			else
+				pentry = &entry->next;
+		}
+	}
+}
+
+static void dir_cache_clear(struct dir_cache *dc)
+{
+	int i;
+
+	for (i = 0; i < dc->num_entries; i++)
+		free(dc->entries[i].name);
+	dc->num_entries = 0;
+	dc->complete = FALSE;
+}
+
+static void dir_cache_free(struct dir_cache *dc)
+{
+	dir_cache_clear(dc);
+	free(dc->entries);
+	free(dc);
+}
+
+/* A detached listing goes once nothing refers to it any more */
+static void dir_cache_release(struct dir_cache *dc)
+{
+	if (dc->detached && dc->refs == 0 && !dc->watching)
+		dir_cache_free(dc);
+}
+
+static void dir_cache_notify_cb(struct smb2_context *smb2, int status,
+                                void *command_data, void *private_data)
+{
+	struct dir_cache *dc = private_data;
+
+	if (command_data != NULL)
+		free_smb2_file_notify_change_information(smb2, command_data);
+
+	/* Whatever changed, the listing has to be read again */
+	dc->complete = FALSE;
+	dc->generation++;
+
+	if (status < 0)
+	{
+		/* The watch has ended, the handle was closed or the connection lost */
+		dc->watching = FALSE;
+		dir_cache_release(dc);
+	}
+}
+
+/* Only used once the connection is gone, so the watches are not closed */
+static void dir_cache_flush(void)
+{
+	struct dir_cache *dc, *next;
+
+	for (dc = fsd->dir_cache; dc != NULL; dc = next)
+	{
+		next = dc->next;
+		dir_cache_free(dc);
+	}
+	fsd->dir_cache = NULL;
+	fsd->dir_cache_count = 0;
+}
+
+static void dir_cache_evict(struct dir_cache *dc)
+{
+	struct dir_cache **pdc;
+	struct smb2fh *fh;
+
+	for (pdc = &fsd->dir_cache; *pdc != NULL; pdc = &(*pdc)->next)
+	{
+		if (*pdc == dc)
+		{
+			*pdc = dc->next;
+			fsd->dir_cache_count--;
+			break;
+		}
+	}
+
+	fh = dc->watch_fh;
+	dc->watch_fh = NULL;
+	dc->detached = TRUE;
+	dc->complete = FALSE;
+
+	/* dc may be gone once this returns, the notify callback frees it */
+	dir_cache_release(dc);
+	if (fh != NULL)
+		smb2_close(fsd->smb2, fh);
+}
+
+static struct dir_cache *dir_cache_find(const char *path, size_t len)
+{
+	struct dir_cache **pdc, *dc;
+
+	for (pdc = &fsd->dir_cache; (dc = *pdc) != NULL; pdc = &dc->next)
+	{
+		if (strncasecmp(dc->path, path, len) == 0 && dc->path[len] == '\0')
+		{
+			/* Keep the list in most recently used order */
+			*pdc = dc->next;
+			dc->next = fsd->dir_cache;
+			fsd->dir_cache = dc;
+			return dc;
+		}
+	}
+
+	return NULL;
+}
+
+static struct dir_cache *dir_cache_add(const char *path)
+{
+	struct dir_cache *dc, *victim;
+
+	if (fsd->dir_cache_count >= cfg_dir_cache)
+	{
+		victim = NULL;
+		for (dc = fsd->dir_cache; dc != NULL; dc = dc->next)
+		{
+			if (dc->refs == 0)
+				victim = dc;
+		}
+		if (victim == NULL)
+			return NULL;
+		dir_cache_evict(victim);
+	}
+
+	dc = calloc(1, sizeof(*dc) + strlen(path) + 1);
+	if (dc == NULL)
+		return NULL;
+
+	strcpy(dc->path, path);
+	dc->next = fsd->dir_cache;
+	fsd->dir_cache = dc;
+	fsd->dir_cache_count++;
+
+	return dc;
+}
+
+static BOOL dir_cache_add_entry(struct dir_cache *dc, const char *name, const struct fbx_stat *stbuf)
+{
+	struct dir_cache_entry *entries;
+	int max_entries;
+
+	if (dc->num_entries == dc->max_entries)
+	{
+		if (dc->max_entries >= DIR_CACHE_MAX_ENTRIES)
+			return FALSE;
+
+		max_entries = dc->max_entries ? (dc->max_entries * 2) : 64;
+		entries = realloc(dc->entries, max_entries * sizeof(*entries));
+		if (entries == NULL)
+			return FALSE;
+
+		dc->entries = entries;
+		dc->max_entries = max_entries;
+	}
+
+	dc->entries[dc->num_entries].name = strdup(name);
+	if (dc->entries[dc->num_entries].name == NULL)
+		return FALSE;
+	dc->entries[dc->num_entries].st = *stbuf;
+	dc->num_entries++;
+
+	return TRUE;
+}
+
+/*
+ * Attach the listing of path to a directory handle that reads it from
+ * the server, so it is filled in as readdir goes. smb2path is the same
+ * path as the server knows it.
+ */
+static void dir_cache_start_fill(struct smb2fs_dir *dh, const char *path, const char *smb2path)
+{
+	struct dir_cache *dc;
+	struct smb2fh *fh;
+
+	dc = dir_cache_find(path, strlen(path));
+	if (dc == NULL)
+	{
+		dc = dir_cache_add(path);
+		if (dc == NULL)
+			return;
+	}
+
+	/* Someone is still reading the old listing */
+	if (dc->refs != 0)
+		return;
+
+	if (!dc->watching)
+	{
+		if (dc->watch_fh != NULL)
+		{
+			smb2_close(fsd->smb2, dc->watch_fh);
+			dc->watch_fh = NULL;
+		}
+
+		fh = smb2_open_dir_handle(fsd->smb2, smb2path);
+		if (fh == NULL)
+			return;
+
+		if (smb2_notify_change_filehandle_async(fsd->smb2, fh, 0,
+			SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_FILE_NAME |
+			SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_DIR_NAME |
+			SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_ATTRIBUTES |
+			SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_SIZE |
+			SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_LAST_WRITE |
+			SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_CREATION,
+			1, dir_cache_notify_cb, dc) < 0)
+		{
+			smb2_close(fsd->smb2, fh);
+			return;
+		}
+
+		dc->watch_fh = fh;
+		dc->watching = TRUE;
+	}
+
+	dir_cache_clear(dc);
+	dc->refs++;
+	dh->dc = dc;
+	dh->generation = dc->generation;
+}
+
+/* The listing of the directory that path is in changed */
+static void dir_cache_invalidate(const char *path)
+{
+	struct dir_cache *dc;
+	size_t len;
+
+	if (fsd->dir_cache == NULL)
+		return;
+
+	len = path_parent_len(path);
+	dc = (len == 0) ? dir_cache_find("/", 1) : dir_cache_find(path, len);
+	if (dc != NULL)
+	{
+		dc->complete = FALSE;
+		dc->generation++;
+	}
+}
+
+/*
+ * Same as dir_cache_invalidate() but also drops the listings of path
+ * and everything below it. Their watches are closed too, as the server
+ * may refuse to rename a directory while something in it is open.
+ */
+static void dir_cache_invalidate_tree(const char *path)
+{
+	struct dir_cache *dc;
+	size_t len = strlen(path);
+
+	dir_cache_invalidate(path);
+
+restart:
+	for (dc = fsd->dir_cache; dc != NULL; dc = dc->next)
+	{
+		if (strncasecmp(dc->path, path, len) == 0 && (dc->path[len] == '\0' || dc->path[len] == '/'))
+		{
+			dir_cache_evict(dc);
+			goto restart;
+		}
+	}
+}
+
 static void *smb2fs_init(struct fuse_conn_info *fci)
 {
 	struct smb2fs_mount_data *md;
@@ -118,6 +832,30 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 	if (md->args[ARG_NO_HANDLES_RCV])
 		cfg_handles_rcv = FALSE;
 
+	if (md->args[ARG_WRITE_BEHIND])
+		cfg_write_behind = *(LONG *)md->args[ARG_WRITE_BEHIND];
+
+	if (md->args[ARG_READ_AHEAD])
+		cfg_read_ahead = *(LONG *)md->args[ARG_READ_AHEAD];
+
+	if (md->args[ARG_ATTR_CACHE_TTL])
+		cfg_attr_cache_ttl = *(LONG *)md->args[ARG_ATTR_CACHE_TTL];
+
+	if (md->args[ARG_DIR_CACHE])
+		cfg_dir_cache = *(LONG *)md->args[ARG_DIR_CACHE];
+
+	if (md->args[ARG_DIR_BUFFER])
+		cfg_dir_buffer = *(LONG *)md->args[ARG_DIR_BUFFER];
+
+	if (md->args[ARG_TRACE])
+		cfg_trace = *(LONG *)md->args[ARG_TRACE];
+
+	if (md->args[ARG_TRACE_FILE])
+		cfg_trace_file = (const char *)md->args[ARG_TRACE_FILE];
+
+	if (md->args[ARG_STATS])
+		cfg_stats = TRUE;
+
 	fsd = calloc(1, sizeof(*fsd));
 	if (fsd == NULL)
 	{
@@ -145,6 +883,15 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 		return NULL;
 	}
 
+	if (cfg_write_behind > 0)
+		smb2_set_write_behind_window(fsd->smb2, (uint32_t)cfg_write_behind * 1024);
+	smb2_set_read_ahead(fsd->smb2, cfg_read_ahead);
+	if (cfg_dir_buffer > 0)
+		smb2_set_dir_buffer_size(fsd->smb2, (uint32_t)cfg_dir_buffer * 1024);
+	if (cfg_trace > 0)
+		smb2_set_trace_size(fsd->smb2, (uint32_t)cfg_trace);
+	smb2_set_sync_stats(fsd->smb2, cfg_stats);
+
 	url = smb2_parse_url(fsd->smb2, (char *)md->args[ARG_URL]);
 	if (url == NULL)
 	{
@@ -278,6 +1025,22 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 	return fsd;
 }
 
+/*
+ * Saves the wire trace of the current context before it goes away, to
+ * TRACEFILE with suffix appended. Read it with libsmb2's smb2-trace.
+ */
+static void dump_trace(const char *suffix)
+{
+	char path[MAXPATHLEN];
+
+	if (cfg_trace <= 0 || fsd == NULL || fsd->smb2 == NULL)
+		return;
+
+	strlcpy(path, cfg_trace_file, sizeof(path));
+	strlcat(path, suffix, sizeof(path));
+	smb2_dump_trace(fsd->smb2, path);
+}
+
 static void smb2fs_destroy(void *initret)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy started.\n");
@@ -295,6 +1058,7 @@ static void smb2fs_destroy(void *initret)
 			// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy disconnected.\n");
 			fsd->connected = FALSE;
 		}
+		dump_trace("");
 		// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy => destroy smb2 context.\n");
 		smb2_destroy_context(fsd->smb2);
 		// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy smb2 context destroyed.\n");
@@ -315,6 +1079,9 @@ static void smb2fs_destroy(void *initret)
 		fsd->phr = NULL;
 	}
 
+	attr_cache_flush();
+	neg_cache_flush();
+	dir_cache_flush();
 
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy => free fsd.\n");
 	free(fsd);
@@ -363,6 +1130,7 @@ static int handle_connection_fault()
 
 	request_error(psz_error);
 	
+	dump_trace(".fault");
 	smb2_destroy_context(fsd->smb2);
 	fsd->smb2 = NULL;
 
@@ -371,6 +1139,9 @@ static int handle_connection_fault()
 		free(fsd->rootdir);
 		fsd->rootdir = NULL;
 	}
+	attr_cache_flush();
+	neg_cache_flush();
+	dir_cache_flush();
 	free(fsd);
 	fsd = NULL;
 
@@ -380,7 +1151,10 @@ static int handle_connection_fault()
 	while(request_reconnect(last_server))
 	{
 		if(smb2fs_init(NULL))
+		{
+			reconnect_count++;
 			return TRUE;
+		}
 	}
 	
 	return FALSE;
@@ -504,6 +1278,7 @@ static int smb2fs_getattr(const char *path, struct fbx_stat *stbuf)
 	struct smb2_stat_64 smb2_st;
 	int                 rc;
 	char                pathbuf[MAXPATHLEN];
+	const char         *cache_path = path;
 
 	if (fsd == NULL)
 	{
@@ -516,6 +1291,12 @@ static int smb2fs_getattr(const char *path, struct fbx_stat *stbuf)
 			return -ENODEV;
 	}
 
+	if (neg_cache_lookup(cache_path))
+		return -ENOENT;
+
+	if (attr_cache_lookup(cache_path, stbuf))
+		return 0;
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -529,6 +1310,8 @@ static int smb2fs_getattr(const char *path, struct fbx_stat *stbuf)
 		rc = smb2_stat(fsd->smb2, path, &smb2_st);
 		if(rc < -1)
 		{
+			if (rc == -ENOENT)
+				neg_cache_store(cache_path);
 			// KPrintF("[smb2fs_getattr] r2: %ld\n", rc);
 			// KPrintF("[smb2fs_getattr] r2_text: %s\n", nterror_to_str(rc));
 			return rc;
@@ -541,6 +1324,7 @@ static int smb2fs_getattr(const char *path, struct fbx_stat *stbuf)
 	} while(rc < 0);
 
 	smb2fs_fillstat(stbuf, &smb2_st);
+	attr_cache_store(cache_path, stbuf);
 
 	return 0;
 }
@@ -549,6 +1333,7 @@ static int smb2fs_fgetattr(const char *path, struct fbx_stat *stbuf,
                            struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_fgetattr started.\n");
+	struct smb2fs_file *file;
 	struct smb2fh      *smb2fh;
 	struct smb2_stat_64 smb2_st;
 	int                 rc;
@@ -565,11 +1350,16 @@ static int smb2fs_fgetattr(const char *path, struct fbx_stat *stbuf,
 	}
 
 	do {
-		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-		if (smb2fh == NULL)
+		file = (struct smb2fs_file *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+		if (file == NULL)
 			return -EINVAL;
+		smb2fh = file->smb2fh;
 
-		rc = smb2_fstat(fsd->smb2, smb2fh, &smb2_st);
+		/* the size must include any writes still in flight, their
+		   errors are left for the next write, fsync or release */
+		rc = smb2_write_behind_wait(fsd->smb2, smb2fh);
+		if (rc == 0)
+			rc = smb2_fstat(fsd->smb2, smb2fh, &smb2_st);
 		if(rc < -1)
 		{
 			// KPrintF("[smb2fs_fgetattr] r2: %ld\n", rc);
@@ -608,6 +1398,10 @@ static int smb2fs_mkdir(const char *path, mode_t mode)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate(path);
+	dir_cache_invalidate(path);
+	neg_cache_invalidate(path, TRUE);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -636,9 +1430,12 @@ static int smb2fs_mkdir(const char *path, mode_t mode)
 static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_opendir started.\n");
-	struct smb2dir *smb2dir;
-	char            pathbuf[MAXPATHLEN];
-	int             r2;
+	struct smb2dir    *smb2dir;
+	struct smb2fs_dir *dh;
+	struct dir_cache  *dc;
+	char               pathbuf[MAXPATHLEN];
+	const char        *cache_path = path;
+	int                r2;
 
 	if (fsd == NULL)
 	{
@@ -651,6 +1448,32 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 			return -ENODEV;
 	}
 
+	dh = calloc(1, sizeof(*dh));
+	if (dh == NULL)
+		return -ENOMEM;
+
+	if (cfg_dir_cache > 0)
+	{
+		/* pick up any change notifications that have arrived meanwhile */
+		smb2_service_nowait(fsd->smb2);
+
+		dc = dir_cache_find(cache_path, strlen(cache_path));
+		if (dc != NULL && dc->complete)
+		{
+			dc->refs++;
+			dh->dc = dc;
+
+			fi->fh = AllocateHandleForPointer(fsd->phr, dh);
+			if (fi->fh == 0)
+			{
+				dc->refs--;
+				free(dh);
+				return -ENOMEM;
+			}
+			return 0;
+		}
+	}
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -667,10 +1490,16 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 			if(r2 == -1 || r2 == SMB2_STATUS_CANCELLED)
 			{
 				if(!handle_connection_fault())
+				{
+					free(dh);
 					return -ENODEV;
+				}
 			}
 			else
+			{
+				free(dh);
 				return -ENOENT;
+			}
 		}
 	} while(smb2dir == NULL);
 	// smb2dir = smb2_opendir(fsd->smb2, path);
@@ -679,10 +1508,18 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 	// 	return -ENOENT;
 	// }
 
+	dh->smb2dir = smb2dir;
+	if (cfg_dir_cache > 0)
+		dir_cache_start_fill(dh, cache_path, path);
+
 	//fi->fh = (uint64_t)(size_t)smb2dir;
-	fi->fh = AllocateHandleForPointer(fsd->phr, smb2dir);
+	fi->fh = AllocateHandleForPointer(fsd->phr, dh);
 	if (fi->fh == 0)
 	{
+		smb2_closedir(fsd->smb2, smb2dir);
+		if (dh->dc != NULL)
+			dh->dc->refs--;
+		free(dh);
 		return -ENOMEM;
 	}
 
@@ -692,7 +1529,7 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 static int smb2fs_releasedir(const char *path, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_releasedir started.\n");
-	struct smb2dir *smb2dir;
+	struct smb2fs_dir *dh;
 
 	if (fsd == NULL)
 	{
@@ -708,11 +1545,18 @@ static int smb2fs_releasedir(const char *path, struct fuse_file_info *fi)
 	// smb2dir = (struct smb2dir *)(size_t)fi->fh;
 	// if (smb2dir == NULL)
 	// 	return -EINVAL;
-	smb2dir = (struct smb2dir *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-	if (smb2dir == NULL)
+	dh = (struct smb2fs_dir *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+	if (dh == NULL)
 		return -EINVAL;
 
-	smb2_closedir(fsd->smb2, smb2dir);
+	if (dh->smb2dir != NULL)
+		smb2_closedir(fsd->smb2, dh->smb2dir);
+	if (dh->dc != NULL)
+	{
+		dh->dc->refs--;
+		dir_cache_release(dh->dc);
+	}
+	free(dh);
 	RemoveHandle(fsd->phr, (uint32_t) fi->fh);
 	fi->fh = (uint64_t)(size_t)NULL;
 
@@ -723,9 +1567,15 @@ static int smb2fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler
 	fbx_off_t offset, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_readdir started.\n");
-	struct smb2dir    *smb2dir;
+	struct smb2fs_dir *dh;
+	struct dir_cache  *dc;
 	struct smb2dirent *ent;
 	struct fbx_stat    stbuf;
+	const char        *name;
+	char               entpath[MAXPATHLEN];
+	size_t             dirlen;
+	int                i = 0;
+	int                rc;
 
 	if (fsd == NULL)
 	{
@@ -744,19 +1594,103 @@ static int smb2fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler
 	// smb2dir = (struct smb2dir *)(size_t)fi->fh;
 	// if (smb2dir == NULL)
 	// 	return -EINVAL;
-	smb2dir = (struct smb2dir *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-	if (smb2dir == NULL)
+	dh = (struct smb2fs_dir *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+	if (dh == NULL)
 		return -EINVAL;
+	dc = dh->dc;
+
+	/* The listing has the same attributes as a stat, so save the
+	   getattr round trips that usually follow for every entry */
+	dirlen = strlcpy(entpath, path, sizeof(entpath));
+	if (dirlen == 0 || entpath[dirlen - 1] != '/')
+		dirlen = strlcat(entpath, "/", sizeof(entpath));
 
-	while ((ent = smb2_readdir(fsd->smb2, smb2dir)) != NULL)
+	for (;;)
 	{
-		smb2fs_fillstat(&stbuf, &ent->st);
-		filler(buffer, ent->name, &stbuf, 0);
+		if (dh->smb2dir == NULL)
+		{
+			/* served from the directory cache */
+			if (i == dc->num_entries)
+				break;
+			name  = dc->entries[i].name;
+			stbuf = dc->entries[i].st;
+			i++;
+		}
+		else
+		{
+			ent = smb2_readdir(fsd->smb2, dh->smb2dir);
+			if (ent == NULL)
+				break;
+			name = ent->name;
+			smb2fs_fillstat(&stbuf, &ent->st);
+
+			if (dc != NULL && !dir_cache_add_entry(dc, name, &stbuf))
+			{
+				/* too big or out of memory, don't cache it after all */
+				dir_cache_clear(dc);
+				dc->refs--;
+				dir_cache_release(dc);
+				dh->dc = dc = NULL;
+			}
+		}
+
+		filler(buffer, name, &stbuf, 0);
+
+		if (dirlen < sizeof(entpath) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+		{
+			entpath[dirlen] = '\0';
+			if (strlcat(entpath, name, sizeof(entpath)) < sizeof(entpath))
+				attr_cache_store(entpath, &stbuf);
+		}
 	}
 
+	if (dh->smb2dir != NULL && (rc = smb2_readdir_status(fsd->smb2, dh->smb2dir)) < 0)
+	{
+		/* the listing was cut short, don't cache what we have */
+		if (dc != NULL)
+		{
+			dir_cache_clear(dc);
+			dc->refs--;
+			dir_cache_release(dc);
+			dh->dc = NULL;
+		}
+		if (rc == -1)
+		{
+			/* the directory handle is lost with the connection,
+			   so the listing can't be resumed */
+			if(!handle_connection_fault())
+				return -ENODEV;
+			return -EIO;
+		}
+		return rc;
+	}
+
+	/* Only complete if nothing changed while we were reading it */
+	if (dh->smb2dir != NULL && dc != NULL && dc->generation == dh->generation)
+		dc->complete = TRUE;
+
 	return 0;
 }
 
+/* Hands an open file to filesysbox, closing it if that fails */
+static int smb2fs_file_handle(struct smb2fh *smb2fh, struct fuse_file_info *fi)
+{
+	struct smb2fs_file *file;
+
+	file = calloc(1, sizeof(*file));
+	if (file != NULL)
+	{
+		file->smb2fh = smb2fh;
+		fi->fh = AllocateHandleForPointer(fsd->phr, file);
+		if (fi->fh != 0)
+			return 0;
+		free(file);
+	}
+
+	smb2_close(fsd->smb2, smb2fh);
+	return -ENOMEM;
+}
+
 static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_open started.\n");
@@ -804,12 +1738,7 @@ static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 		if (smb2fh != NULL)
 		{
 			// fi->fh = (uint64_t)(size_t)smb2fh;
-			fi->fh = AllocateHandleForPointer(fsd->phr, smb2fh);
-			if (fi->fh == 0)
-			{
-				return -ENOMEM;
-			}
-			return 0;
+			return smb2fs_file_handle(smb2fh, fi);
 		}
 		else
 		{
@@ -846,6 +1775,10 @@ static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *f
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate(path);
+	dir_cache_invalidate(path);
+	neg_cache_invalidate(path, FALSE);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -870,12 +1803,7 @@ static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *f
 	if (smb2fh != NULL)
 	{
 		// fi->fh = (uint64_t)(size_t)smb2fh;
-		fi->fh = AllocateHandleForPointer(fsd->phr, smb2fh);
-		if (fi->fh == 0)
-		{
-			return -ENOMEM;
-		}
-		return 0;
+		return smb2fs_file_handle(smb2fh, fi);
 	}
 
 	return -1; // r2
@@ -884,7 +1812,53 @@ static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *f
 static int smb2fs_release(const char *path, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_release started.\n");
-	struct smb2fh *smb2fh;
+	struct smb2fs_file *file;
+	struct smb2fh      *smb2fh;
+	int                 rc;
+
+	if (fsd == NULL)
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	// smb2fh = (struct smb2fh *)(size_t)fi->fh;
+	// if (smb2fh == NULL)
+	// 	return -EINVAL;
+	file = (struct smb2fs_file *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+	if (file == NULL)
+		return -EINVAL;
+	smb2fh = file->smb2fh;
+
+	/* report errors of writes that completed after smb2fs_write returned */
+	rc = smb2_write_behind_flush(fsd->smb2, smb2fh);
+	if (rc == -1)
+		rc = -EIO;
+
+	smb2_close(fsd->smb2, smb2fh);
+	/* the server may update the timestamps when the file is closed,
+	   and a listing read while it was written may have the old size */
+	attr_cache_invalidate(path);
+	if (file->written)
+		dir_cache_invalidate(path);
+	RemoveHandle(fsd->phr, (uint32_t) fi->fh);
+	free(file);
+	fi->fh = (uint64_t)(size_t)NULL;
+
+	return rc;
+}
+
+static int smb2fs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_fsync started.\n");
+	struct smb2fs_file *file;
+	struct smb2fh      *smb2fh;
+	int                 rc;
 
 	if (fsd == NULL)
 	{
@@ -897,18 +1871,27 @@ static int smb2fs_release(const char *path, struct fuse_file_info *fi)
 			return -ENODEV;
 	}
 
-	// smb2fh = (struct smb2fh *)(size_t)fi->fh;
-	// if (smb2fh == NULL)
-	// 	return -EINVAL;
-	smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-	if (smb2fh == NULL)
+	if (fsd->rdonly)
+		return 0;
+
+	file = (struct smb2fs_file *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+	if (file == NULL)
 		return -EINVAL;
+	smb2fh = file->smb2fh;
 
-	smb2_close(fsd->smb2, smb2fh);
-	RemoveHandle(fsd->phr, (uint32_t) fi->fh);
-	fi->fh = (uint64_t)(size_t)NULL;
+	rc = smb2_write_behind_flush(fsd->smb2, smb2fh);
+	attr_cache_invalidate(path);
+	if (rc == 0)
+		rc = smb2_fsync(fsd->smb2, smb2fh);
+	if (rc == -1)
+	{
+		/* any data that was still in flight is lost with the connection */
+		if(!handle_connection_fault())
+			return -ENODEV;
+		return -EIO;
+	}
 
-	return 0;
+	return rc;
 }
 
 
@@ -916,13 +1899,10 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
                        fbx_off_t offset, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_read started with path:\"%s\".\n", path);
-	struct smb2fh *smb2fh;
-	int64_t        new_offset;
-	size_t         max_read_size, count;
-	int            rc = 0;
+	struct smb2fs_file *file;
+	struct smb2fh      *smb2fh;
+	int                 rc = 0;
 	int				rc_open = 0;
-	int            result;
-	char 			*buffer_ref;
 
 	if (fsd == NULL)
 	{
@@ -943,75 +1923,50 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
 	}
 
 	do {
-		buffer_ref = buffer;
-
-		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-		if (smb2fh == NULL)
+		file = (struct smb2fs_file *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+		if (file == NULL)
 			return -EINVAL;
+		smb2fh = file->smb2fh;
 
-		new_offset = smb2_lseek(fsd->smb2, smb2fh, offset, SEEK_SET, NULL);
-		if (new_offset < 0)
+		/* sequential reads are served from the read-ahead buffer, anything
+		   else is read as pipelined chunks, a short result means end of file */
+		rc = smb2_write_behind_wait(fsd->smb2, smb2fh);
+		if (rc == 0)
+			rc = smb2_pread_ahead(fsd->smb2, smb2fh, (uint8_t *)buffer, size, offset);
+		if(rc < -1)
 		{
-			return (int)new_offset;
+			return rc;
 		}
-
-		max_read_size = smb2_get_max_read_size(fsd->smb2);
-		//IExec->DebugPrintF("max_read_size: %lu\n", max_read_size);
-		result = 0;
-
-		while (size > 0)
+		else if (rc < 0)
 		{
-			count = size;
-			if (count > max_read_size)
-				count = max_read_size;
+			if(!handle_connection_fault())
+				return -ENODEV;
 
-			rc = smb2_read(fsd->smb2, smb2fh, (uint8_t *)buffer_ref, count);
-			if (rc == 0)
-			{
-				break;
-			}
-			else if(rc < -1)
+			if(cfg_handles_rcv)
 			{
-				return rc;
+				rc_open = smb2fs_open(path, fi);
+				if(rc_open < 0)
+					return -EIO;
 			}
-			else if (rc < 0)
+			else
 			{
-				if(!handle_connection_fault())
-					return -ENODEV;
-
-				if(cfg_handles_rcv)
-				{
-					rc_open = smb2fs_open(path, fi);
-					if(rc_open < 0)
-						return -EIO;
-				}
-				else
-				{
-					/* even if connection has reestablished, we do not have a handle recovery for now and need to fail the op */
-					return -EIO;
-				}
+				/* even if connection has reestablished, we do not have a handle recovery for now and need to fail the op */
+				return -EIO;
 			}
-
-			result += rc;
-			buffer_ref += rc;
-			size   -= rc;
 		}
 	} while(rc < 0);
 
-	return result;
+	return rc;
 }
 
 static int smb2fs_write(const char *path, const char *buffer, size_t size,
                         fbx_off_t offset, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_write started.\n");
-	struct smb2fh *smb2fh;
-	int64_t        new_offset;
-	size_t         max_write_size, count;
-	int            rc = 0;
+	struct smb2fs_file *file;
+	struct smb2fh      *smb2fh;
+	int                 rc = 0;
 	int				rc_open = 0;
-	int            result;
-	const char		*buffer_ref;
 
 	if (fsd == NULL)
 	{
@@ -1034,62 +1989,41 @@ static int smb2fs_write(const char *path, const char *buffer, size_t size,
 	if (fsd->rdonly)
 		return -EROFS;
 
-	do {
-		buffer_ref = buffer;
-		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-		if (smb2fh == NULL)
-			return -EINVAL;
+	file = (struct smb2fs_file *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+	if (file == NULL)
+		return -EINVAL;
+	smb2fh = file->smb2fh;
 
-		new_offset = smb2_lseek(fsd->smb2, smb2fh, offset, SEEK_SET, NULL);
-		if (new_offset < 0)
-		{
-			return (int)new_offset;
-		}
+	/* Once per handle is enough for the listing, every chunk would
+	   keep it from ever being cached again during a long copy */
+	attr_cache_invalidate(path);
+	if (!file->written)
+	{
+		dir_cache_invalidate(path);
+		file->written = TRUE;
+	}
 
-		max_write_size = smb2_get_max_write_size(fsd->smb2);
-		//IExec->DebugPrintF("max_write_size: %lu\n", max_write_size);
-		result = 0;
+	/* the data is copied and sent in the background, errors of earlier
+	   writes on this handle are reported here */
+	rc = smb2_pwrite_behind(fsd->smb2, smb2fh, (const uint8_t *)buffer, size, offset);
+	if (rc == -1)
+	{
+		if(!handle_connection_fault())
+			return -ENODEV;
 
-		while (size > 0)
+		if(cfg_handles_rcv)
 		{
-			count = size;
-			if (count > max_write_size)
-				count = max_write_size;
-
-			rc = smb2_write(fsd->smb2, smb2fh, (const uint8_t *)buffer_ref, count);
-			if (rc == 0)
-			{
-				break;
-			}
-			else if(rc < -1)
-			{
-				return rc;
-			}
-			else if (rc < 0)
-			{
-				if(!handle_connection_fault())
-					return -ENODEV;
-
-				if(cfg_handles_rcv)
-				{
-					rc_open = smb2fs_open(path, fi);
-					if(rc_open < 0)
-						return -EIO;
-				}
-				else
-				{
-					/* even if connection has reestablished, we do not have a handle recovery for now and need to fail the op */
-					return -EIO;
-				}
-			}
-
-			result += rc;
-			buffer_ref += rc;
-			size   -= rc;
+			rc_open = smb2fs_open(path, fi);
+			if(rc_open < 0)
+				return -EIO;
 		}
-	} while(rc < 0);
 
-	return result;
+		/* writes that were still in flight are lost with the connection,
+		   so we can't just retry this one */
+		return -EIO;
+	}
+
+	return rc;
 }
 
 static int smb2fs_truncate(const char *path, fbx_off_t size)
@@ -1112,6 +2046,9 @@ static int smb2fs_truncate(const char *path, fbx_off_t size)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate(path);
+	dir_cache_invalidate(path);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1140,8 +2077,9 @@ static int smb2fs_truncate(const char *path, fbx_off_t size)
 static int smb2fs_ftruncate(const char *path, fbx_off_t size, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_ftruncate started.\n");
-	struct smb2fh *smb2fh;
-	int            rc;
+	struct smb2fs_file *file;
+	struct smb2fh      *smb2fh;
+	int                 rc;
 	int				rc_open = 0;
 
 	if (fsd == NULL)
@@ -1165,13 +2103,19 @@ static int smb2fs_ftruncate(const char *path, fbx_off_t size, struct fuse_file_i
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate(path);
+	dir_cache_invalidate(path);
+
 	
 	do {
-		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-		if (smb2fh == NULL)
+		file = (struct smb2fs_file *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+		if (file == NULL)
 			return -EINVAL;
+		smb2fh = file->smb2fh;
 
-		rc = smb2_ftruncate(fsd->smb2, smb2fh, size);
+		rc = smb2_write_behind_wait(fsd->smb2, smb2fh);
+		if (rc == 0)
+			rc = smb2_ftruncate(fsd->smb2, smb2fh, size);
 		if(rc < -1)
 		{
 			return rc;
@@ -1217,6 +2161,9 @@ static int smb2fs_utimens(const char *path, const struct timespec tv[2])
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate(path);
+	dir_cache_invalidate(path);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1255,6 +2202,9 @@ static int smb2fs_unlink(const char *path)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate(path);
+	dir_cache_invalidate(path);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1283,13 +2233,8 @@ static int smb2fs_unlink(const char *path)
 static int smb2fs_rmdir(const char *path)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_rmdir started.\n");
-	struct smb2dir *smb2dir;
 	int  rc;
 	char pathbuf[MAXPATHLEN];
-	int  r2;
-	struct smb2dirent *ent;
-	BOOL notempty = FALSE;
-
 
 	if (fsd == NULL)
 	{
@@ -1305,6 +2250,9 @@ static int smb2fs_rmdir(const char *path)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate_tree(path);
+	dir_cache_invalidate_tree(path);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1314,37 +2262,7 @@ static int smb2fs_rmdir(const char *path)
 
 	if (path[0] == '/') path++; /* Remove initial slash */
 
-	/* Make sure to return correct error for non-empty directory */
-	do {
-		smb2dir = smb2_opendir_r2(fsd->smb2, path, &r2);
-		if (smb2dir == NULL)
-		{
-			if(r2 == -1 || r2 == SMB2_STATUS_CANCELLED)
-			{
-				if(!handle_connection_fault())
-					return -ENODEV;
-			}
-			else
-				return -ENOENT;
-		}
-	} while(smb2dir == NULL);
-
-	
-	while ((ent = smb2_readdir(fsd->smb2, smb2dir)) != NULL)
-	{
-		if (strcmp(ent->name, ".") != 0 && strcmp(ent->name, "..") != 0)
-		{
-			notempty = TRUE;
-			break;
-		}
-	}
-	smb2_closedir(fsd->smb2, smb2dir);
-
-	if (notempty)
-	{
-		return -ENOTEMPTY;
-	}
-
+	/* The delete itself fails with -ENOTEMPTY for a non-empty directory */
 	do {
 		rc = smb2_rmdir(fsd->smb2, path);
 		if(rc < -1)
@@ -1424,6 +2342,12 @@ static int smb2fs_rename(const char *srcpath, const char *dstpath)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	attr_cache_invalidate_tree(srcpath);
+	attr_cache_invalidate_tree(dstpath);
+	dir_cache_invalidate_tree(srcpath);
+	dir_cache_invalidate_tree(dstpath);
+	neg_cache_invalidate(dstpath, TRUE);
+
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(srcpathbuf, fsd->rootdir, sizeof(srcpathbuf));
@@ -1474,6 +2398,7 @@ static struct fuse_operations smb2fs_ops =
 	.open       = smb2fs_open,
 	.create     = smb2fs_create,
 	.release    = smb2fs_release,
+	.fsync      = smb2fs_fsync,
 	.read       = smb2fs_read,
 	.write      = smb2fs_write,
 	.truncate   = smb2fs_truncate,
@@ -1486,6 +2411,463 @@ static struct fuse_operations smb2fs_ops =
 	.relabel    = smb2fs_relabel
 };
 
+/*
+ * Per operation statistics, enabled with the STATS switch. The handler
+ * then uses smb2fs_stats_ops, which times every operation and splits the
+ * time into what was spent waiting for the server (as accounted by
+ * libsmb2 in smb2->sync_stats) and what was spent in the handler itself.
+ * The numbers can be read from the virtual file STATS_FILE in the root of
+ * the volume, e.g. "Type SMB2:.smb2-stats".
+ *
+ * The counters live outside of fsd as that is freed on a reconnect.
+ */
+#define STATS_FILE "/.smb2-stats"
+#define STATS_BUFFER_SIZE 16384
+
+enum {
+	OP_STATFS,
+	OP_GETATTR,
+	OP_FGETATTR,
+	OP_MKDIR,
+	OP_OPENDIR,
+	OP_RELEASEDIR,
+	OP_READDIR,
+	OP_OPEN,
+	OP_CREATE,
+	OP_RELEASE,
+	OP_FSYNC,
+	OP_READ,
+	OP_WRITE,
+	OP_TRUNCATE,
+	OP_FTRUNCATE,
+	OP_UTIMENS,
+	OP_UNLINK,
+	OP_RMDIR,
+	OP_READLINK,
+	OP_RENAME,
+	NUM_OPS
+};
+
+static const char *const op_names[NUM_OPS] =
+{
+	"statfs", "getattr", "fgetattr", "mkdir", "opendir", "releasedir",
+	"readdir", "open", "create", "release", "fsync", "read", "write",
+	"truncate", "ftruncate", "utimens", "unlink", "rmdir", "readlink",
+	"rename"
+};
+
+struct op_stats {
+	uint32_t calls;
+	uint32_t errors;
+	uint32_t reconnects;
+	uint32_t round_trips;
+	uint64_t bytes;
+	uint64_t total_us;
+	uint64_t wait_us;
+	uint32_t hist[SMB2_LATENCY_BUCKETS];
+};
+
+/* State saved by stats_begin() for stats_end() */
+struct op_timer {
+	uint64_t             start;
+	struct smb2_context *smb2;
+	uint32_t             reconnects;
+	uint32_t             waits;
+	uint64_t             wait_us;
+};
+
+/* What fi->fh of the open statistics file points to */
+struct stats_handle {
+	size_t len;
+	char   text[];
+};
+
+static struct op_stats op_stats[NUM_OPS];
+static char            stats_text[STATS_BUFFER_SIZE];
+static size_t          stats_text_len;
+static int             stats_open_count;
+static size_t          stats_open_len; /* of the latest open snapshot */
+
+static uint64_t stats_now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void stats_begin(struct op_timer *t)
+{
+	t->smb2       = fsd != NULL ? fsd->smb2 : NULL;
+	t->reconnects = reconnect_count;
+	t->waits      = t->smb2 != NULL ? t->smb2->sync_stats.waits : 0;
+	t->wait_us    = t->smb2 != NULL ? t->smb2->sync_stats.wait_us : 0;
+	t->start      = stats_now_us();
+}
+
+static void stats_end(const struct op_timer *t, int op, int rc, size_t bytes)
+{
+	struct op_stats     *os = &op_stats[op];
+	struct smb2_context *smb2 = fsd != NULL ? fsd->smb2 : NULL;
+	uint64_t             now = stats_now_us();
+	uint64_t             us = now > t->start ? now - t->start : 0;
+
+	os->calls++;
+	if (rc < 0)
+		os->errors++;
+	os->reconnects += reconnect_count - t->reconnects;
+	os->bytes += bytes;
+	os->total_us += us;
+	os->hist[smb2_latency_bucket(us)]++;
+
+	if (smb2 == NULL)
+		return;
+
+	/* A reconnect during the call means a new context with fresh counters */
+	if (smb2 != t->smb2 || reconnect_count != t->reconnects)
+	{
+		os->round_trips += smb2->sync_stats.waits;
+		os->wait_us += smb2->sync_stats.wait_us;
+	}
+	else
+	{
+		os->round_trips += smb2->sync_stats.waits - t->waits;
+		os->wait_us += smb2->sync_stats.wait_us - t->wait_us;
+	}
+}
+
+static void stats_append(size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int     n;
+
+	if (*len >= sizeof(stats_text) - 1)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(stats_text + *len, sizeof(stats_text) - *len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		*len = MIN(*len + n, sizeof(stats_text) - 1);
+}
+
+/* Only the non-empty buckets are listed, labelled by their upper bound */
+static void stats_append_hist(size_t *len, const uint32_t *hist)
+{
+	unsigned long bound;
+	int           i;
+
+	for (i = 0; i < SMB2_LATENCY_BUCKETS; i++)
+	{
+		if (hist[i] == 0)
+			continue;
+
+		bound = 1UL << i;
+		if (i == SMB2_LATENCY_BUCKETS - 1)
+			stats_append(len, " >=%lums:%lu", (bound >> 1) / 1000, (unsigned long)hist[i]);
+		else if (bound < 1024)
+			stats_append(len, " <%luus:%lu", bound, (unsigned long)hist[i]);
+		else
+			stats_append(len, " <%lums:%lu", bound / 1000, (unsigned long)hist[i]);
+	}
+	stats_append(len, "\n");
+}
+
+static void stats_snapshot(void)
+{
+	const struct op_stats *os;
+	struct smb2_context   *smb2 = fsd != NULL ? fsd->smb2 : NULL;
+	size_t                 len = 0;
+	int                    i;
+
+	stats_append(&len, "%-10s %8s %6s %5s %10s %8s %10s %10s %8s\n",
+		"op", "calls", "errors", "recon", "kbytes", "rtts",
+		"total_ms", "server_ms", "avg_us");
+	for (i = 0; i < NUM_OPS; i++)
+	{
+		os = &op_stats[i];
+		if (os->calls == 0)
+			continue;
+
+		stats_append(&len, "%-10s %8lu %6lu %5lu %10lu %8lu %10lu %10lu %8lu\n",
+			op_names[i],
+			(unsigned long)os->calls,
+			(unsigned long)os->errors,
+			(unsigned long)os->reconnects,
+			(unsigned long)(os->bytes >> 10),
+			(unsigned long)os->round_trips,
+			(unsigned long)(os->total_us / 1000),
+			(unsigned long)(os->wait_us / 1000),
+			(unsigned long)(os->total_us / os->calls));
+	}
+
+	stats_append(&len, "\nlatency:\n");
+	for (i = 0; i < NUM_OPS; i++)
+	{
+		os = &op_stats[i];
+		if (os->calls == 0)
+			continue;
+
+		stats_append(&len, "%-10s", op_names[i]);
+		stats_append_hist(&len, os->hist);
+	}
+
+	stats_append(&len, "\nserver round trips since the last (re)connect: %lu\n",
+		smb2 != NULL ? (unsigned long)smb2->sync_stats.waits : 0UL);
+	if (smb2 != NULL)
+	{
+		stats_append(&len, "%-10s", "rtt");
+		stats_append_hist(&len, smb2->sync_stats.hist);
+	}
+	stats_append(&len, "reconnects: %lu\n", (unsigned long)reconnect_count);
+
+	stats_text_len = len;
+}
+
+static BOOL is_stats_file(const char *path)
+{
+	return strcmp(path, STATS_FILE) == 0;
+}
+
+static void stats_fillstat(struct fbx_stat *stbuf, size_t size)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_mode  = S_IFREG | S_IRUSR;
+	stbuf->st_nlink = 1;
+	stbuf->st_size  = size;
+	stbuf->st_mtime = time(NULL);
+	stbuf->st_atime = stbuf->st_mtime;
+	stbuf->st_ctime = stbuf->st_mtime;
+}
+
+/*
+ * The statistics file only exists in the handler, so the operations
+ * are answered with stats_rc when stats_path says they are aimed at it
+ * instead of being sent to the server.
+ */
+#define STATS_OP(name, op, params, args, stats_path, stats_rc, bytes) \
+static int stats_##name params \
+{ \
+	struct op_timer t; \
+	int             rc; \
+	if (stats_path) \
+		return stats_rc; \
+	stats_begin(&t); \
+	rc = smb2fs_##name args; \
+	stats_end(&t, op, rc, bytes); \
+	return rc; \
+}
+
+STATS_OP(statfs, OP_STATFS,
+	(const char *path, struct statvfs *sfs),
+	(path, sfs),
+	0, 0, 0)
+STATS_OP(mkdir, OP_MKDIR,
+	(const char *path, mode_t mode),
+	(path, mode),
+	is_stats_file(path), -EEXIST, 0)
+STATS_OP(opendir, OP_OPENDIR,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi),
+	is_stats_file(path), -ENOTDIR, 0)
+STATS_OP(releasedir, OP_RELEASEDIR,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi),
+	0, 0, 0)
+STATS_OP(readdir, OP_READDIR,
+	(const char *path, void *buffer, fuse_fill_dir_t filler, fbx_off_t offset, struct fuse_file_info *fi),
+	(path, buffer, filler, offset, fi),
+	is_stats_file(path), -ENOTDIR, 0)
+STATS_OP(create, OP_CREATE,
+	(const char *path, mode_t mode, struct fuse_file_info *fi),
+	(path, mode, fi),
+	is_stats_file(path), -EACCES, 0)
+STATS_OP(fsync, OP_FSYNC,
+	(const char *path, int isdatasync, struct fuse_file_info *fi),
+	(path, isdatasync, fi),
+	is_stats_file(path), 0, 0)
+STATS_OP(truncate, OP_TRUNCATE,
+	(const char *path, fbx_off_t size),
+	(path, size),
+	is_stats_file(path), -EACCES, 0)
+STATS_OP(ftruncate, OP_FTRUNCATE,
+	(const char *path, fbx_off_t size, struct fuse_file_info *fi),
+	(path, size, fi),
+	is_stats_file(path), -EACCES, 0)
+STATS_OP(utimens, OP_UTIMENS,
+	(const char *path, const struct timespec tv[2]),
+	(path, tv),
+	is_stats_file(path), -EACCES, 0)
+STATS_OP(unlink, OP_UNLINK,
+	(const char *path),
+	(path),
+	is_stats_file(path), -EACCES, 0)
+STATS_OP(rmdir, OP_RMDIR,
+	(const char *path),
+	(path),
+	is_stats_file(path), -ENOTDIR, 0)
+STATS_OP(readlink, OP_READLINK,
+	(const char *path, char *buffer, size_t size),
+	(path, buffer, size),
+	is_stats_file(path), -EINVAL, 0)
+STATS_OP(rename, OP_RENAME,
+	(const char *srcpath, const char *dstpath),
+	(srcpath, dstpath),
+	is_stats_file(srcpath) || is_stats_file(dstpath), -EACCES, 0)
+STATS_OP(write, OP_WRITE,
+	(const char *path, const char *buffer, size_t size, fbx_off_t offset, struct fuse_file_info *fi),
+	(path, buffer, size, offset, fi),
+	is_stats_file(path), -EACCES, rc > 0 ? rc : 0)
+
+/* The operations below also serve the statistics file */
+
+static int stats_getattr(const char *path, struct fbx_stat *stbuf)
+{
+	struct op_timer t;
+	int             rc;
+
+	if (is_stats_file(path))
+	{
+		/* While it is open report the size of what is being read */
+		if (stats_open_count == 0)
+		{
+			stats_snapshot();
+			stats_fillstat(stbuf, stats_text_len);
+		}
+		else
+			stats_fillstat(stbuf, stats_open_len);
+		return 0;
+	}
+
+	stats_begin(&t);
+	rc = smb2fs_getattr(path, stbuf);
+	stats_end(&t, OP_GETATTR, rc, 0);
+	return rc;
+}
+
+static int stats_fgetattr(const char *path, struct fbx_stat *stbuf,
+                          struct fuse_file_info *fi)
+{
+	struct op_timer t;
+	int             rc;
+
+	if (is_stats_file(path))
+	{
+		struct stats_handle *sh = (struct stats_handle *)(size_t)fi->fh;
+
+		stats_fillstat(stbuf, sh->len);
+		return 0;
+	}
+
+	stats_begin(&t);
+	rc = smb2fs_fgetattr(path, stbuf, fi);
+	stats_end(&t, OP_FGETATTR, rc, 0);
+	return rc;
+}
+
+static int stats_open(const char *path, struct fuse_file_info *fi)
+{
+	struct op_timer t;
+	int             rc;
+
+	if (is_stats_file(path))
+	{
+		struct stats_handle *sh;
+
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+
+		/* Taken once per open so reads see a consistent snapshot */
+		stats_snapshot();
+		sh = malloc(sizeof(*sh) + stats_text_len);
+		if (sh == NULL)
+			return -ENOMEM;
+
+		sh->len = stats_text_len;
+		memcpy(sh->text, stats_text, stats_text_len);
+		fi->fh = (uint64_t)(size_t)sh;
+		stats_open_count++;
+		stats_open_len = sh->len;
+		return 0;
+	}
+
+	stats_begin(&t);
+	rc = smb2fs_open(path, fi);
+	stats_end(&t, OP_OPEN, rc, 0);
+	return rc;
+}
+
+static int stats_release(const char *path, struct fuse_file_info *fi)
+{
+	struct op_timer t;
+	int             rc;
+
+	if (is_stats_file(path))
+	{
+		free((struct stats_handle *)(size_t)fi->fh);
+		fi->fh = 0;
+		stats_open_count--;
+		return 0;
+	}
+
+	stats_begin(&t);
+	rc = smb2fs_release(path, fi);
+	stats_end(&t, OP_RELEASE, rc, 0);
+	return rc;
+}
+
+static int stats_read(const char *path, char *buffer, size_t size,
+                      fbx_off_t offset, struct fuse_file_info *fi)
+{
+	struct op_timer t;
+	int             rc;
+
+	if (is_stats_file(path))
+	{
+		struct stats_handle *sh = (struct stats_handle *)(size_t)fi->fh;
+
+		if (offset < 0 || offset >= (fbx_off_t)sh->len)
+			return 0;
+
+		size = MIN(size, sh->len - (size_t)offset);
+		memcpy(buffer, sh->text + offset, size);
+		return size;
+	}
+
+	stats_begin(&t);
+	rc = smb2fs_read(path, buffer, size, offset, fi);
+	stats_end(&t, OP_READ, rc, rc > 0 ? rc : 0);
+	return rc;
+}
+
+static struct fuse_operations smb2fs_stats_ops =
+{
+	.init       = smb2fs_init,
+	.destroy    = smb2fs_destroy,
+	.statfs     = stats_statfs,
+	.getattr    = stats_getattr,
+	.fgetattr   = stats_fgetattr,
+	.mkdir      = stats_mkdir,
+	.opendir    = stats_opendir,
+	.releasedir = stats_releasedir,
+	.readdir    = stats_readdir,
+	.open       = stats_open,
+	.create     = stats_create,
+	.release    = stats_release,
+	.fsync      = stats_fsync,
+	.read       = stats_read,
+	.write      = stats_write,
+	.truncate   = stats_truncate,
+	.ftruncate  = stats_ftruncate,
+	.utimens    = stats_utimens,
+	.unlink     = stats_unlink,
+	.rmdir      = stats_rmdir,
+	.readlink   = stats_readlink,
+	.rename     = stats_rename,
+	.relabel    = smb2fs_relabel
+};
+
 static void remove_double_quotes(char *argstr)
 {
 	char *start, *end;
@@ -1582,6 +2964,7 @@ int smb2fs_main(struct DosPacket *pkt)
 #ifdef __amigaos4__
 	uint32                    fsflags;
 #endif
+	struct fuse_operations   *ops;
 	struct FbxFS             *fs = NULL;
 	int                       error;
 	int                       rc = RETURN_ERROR;
@@ -1614,10 +2997,12 @@ int smb2fs_main(struct DosPacket *pkt)
 		goto cleanup;
 	}
 
+	ops = md.args[ARG_STATS] ? &smb2fs_stats_ops : &smb2fs_ops;
+
 #ifdef __amigaos4__
 	fsflags = FBXF_ENABLE_UTF8_NAMES|FBXF_ENABLE_32BIT_UIDS|FBXF_USE_FILL_DIR_STAT;
 
-	fs = FbxSetupFSTags(pkt->dp_Link, &smb2fs_ops, sizeof(smb2fs_ops), &md,
+	fs = FbxSetupFSTags(pkt->dp_Link, ops, sizeof(*ops), &md,
 		FBXT_FSFLAGS,     fsflags,
 		FBXT_DOSTYPE,     ID_SMB2_DISK,
 		FBXT_GET_CONTEXT, &_fuse_context_,
@@ -1630,7 +3015,7 @@ int smb2fs_main(struct DosPacket *pkt)
 		{ TAG_END,          0                                                       }
 	};
 
-	fs = FbxSetupFS(pkt->dp_Link, fs_tags, &smb2fs_ops, sizeof(smb2fs_ops), &md);
+	fs = FbxSetupFS(pkt->dp_Link, fs_tags, ops, sizeof(*ops), &md);
 #endif
 
 	/* Set to NULL so we don't reply the message twice */